@@ -51,6 +51,7 @@ SOURCES += \
     src/core/auth/qgsauthenticationmanager.cpp \
     src/core/auth/qgsauthenticationconfig.cpp \
     src/core/auth/qgsauthenticationcrypto.cpp \
+    src/core/auth/qgsauthenticationdb.cpp \
     src/core/auth/qgsauthenticationprovider.cpp \
     src/gui/auth/qgsauthenticationconfigwidget.cpp \
     src/gui/auth/qgsauthenticationconfigeditor.cpp \
@@ -62,6 +63,7 @@ SOURCES += \
     src/gui/auth/qgsauthenticationcertificateinfo.cpp \
     src/gui/auth/qgsauthenticationimportcertdialog.cpp \
     src/core/auth/qgsauthenticationcertutils.cpp \
+    src/core/auth/qgsauthenticationcertregistry.cpp \
     src/gui/auth/qgsauthenticationcerttrustpolicycombobox.cpp \
     src/gui/auth/qgsauthenticationtrustedcasdialog.cpp \
     src/gui/auth/qgsauthenticationimportidentitydialog.cpp \
@@ -85,8 +87,10 @@ HEADERS += \
     src/gui/qgsmessagebar.h \
     src/gui/qgsmessagebaritem.h \
     src/core/auth/qgsauthenticationmanager.h \
+    src/core/auth/qgsauthenticationcache.h \
     src/core/auth/qgsauthenticationconfig.h \
     src/core/auth/qgsauthenticationcrypto.h \
+    src/core/auth/qgsauthenticationdb.h \
     src/core/auth/qgsauthenticationprovider.h \
     src/gui/auth/qgsauthenticationconfigwidget.h \
     src/gui/auth/qgsauthenticationconfigeditor.h \
@@ -99,6 +103,7 @@ HEADERS += \
     src/gui/auth/qgsauthenticationcertificateinfo.h \
     src/gui/auth/qgsauthenticationimportcertdialog.h \
     src/core/auth/qgsauthenticationcertutils.h \
+    src/core/auth/qgsauthenticationcertregistry.h \
     src/gui/auth/qgsauthenticationcerttrustpolicycombobox.h \
     src/gui/auth/qgsauthenticationtrustedcasdialog.h \
     src/gui/auth/qgsauthenticationimportidentitydialog.h \
@@ -0,0 +1,341 @@
+/***************************************************************************
+    qgsauthenticationcache.h
+    ---------------------
+    begin                : October 17, 2026
+    copyright            : (C) 2026 by QGIS Development Team
+    author               : QGIS Development Team
+    email                : qgis-developer at lists dot osgeo dot org
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef QGSAUTHENTICATIONCACHE_H
+#define QGSAUTHENTICATIONCACHE_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QReadWriteLock>
+#include <QSettings>
+#include <QString>
+
+/** \ingroup core
+ * \brief Counters and size of a QgsAuthCache
+ * \since 2.8
+ */
+struct CORE_EXPORT QgsAuthCacheStats
+{
+  QgsAuthCacheStats()
+      : entries( 0 ), bytes( 0 ), hits( 0 ), misses( 0 ), evictions( 0 ) {}
+
+  int entries;
+  qint64 bytes;
+  quint64 hits;
+  quint64 misses;
+  quint64 evictions; //!< Removed for capacity or idle expiry, not explicit removals
+};
+
+/** \ingroup core
+ * \brief Types shared by all QgsAuthCache instantiations
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthCacheBase
+{
+  public:
+    enum EvictionReason
+    {
+      Capacity,
+      Expired
+    };
+
+    /** Called after an entry is evicted, outside of the cache's lock */
+    typedef void ( *EvictionCallback )( const QString& name, const QString& key, EvictionReason reason );
+};
+
+/** \ingroup core
+ * \brief Bounded, thread-safe cache for provider credentials, keyed by authcfg id
+ *
+ * Entries are evicted least-recently-used first when over max entries or max bytes
+ * (as costed on insert), and are expired after an idle time-to-live. Lookups take a read
+ * lock, so concurrent network requests do not serialize on a warm cache, plus a brief lock
+ * for recency and counters. Expired entries are purged on insert, on lookup of an expired
+ * entry and when stats are queried.
+ * \note A limit of 0 means unlimited
+ * \since 2.8
+ */
+template <typename T>
+class QgsAuthCache : public QgsAuthCacheBase
+{
+  public:
+    explicit QgsAuthCache( const QString& name, int maxEntries = 0, qint64 maxBytes = 0, int idleTtl = 0 )
+        : mName( name )
+        , mMaxEntries( maxEntries )
+        , mMaxBytes( maxBytes )
+        , mIdleTtl( idleTtl )
+        , mBytes( 0 )
+        , mTick( 0 )
+        , mHits( 0 )
+        , mMisses( 0 )
+        , mEvictions( 0 )
+        , mCallback( 0 )
+    {}
+
+    ~QgsAuthCache() { clear(); }
+
+    /** Cache name, e.g. provider type, for logging */
+    const QString name() const { return mName; }
+
+    /**
+     * Set limits, evicting now if over them
+     * @param maxEntries Max number of entries
+     * @param maxBytes Max summed cost of entries
+     * @param idleTtl Seconds an entry may go unused before it expires
+     */
+    void setLimits( int maxEntries, qint64 maxBytes, int idleTtl )
+    {
+      Evictions evicted;
+      EvictionCallback callback;
+      {
+        QWriteLocker locker( &mLock );
+        callback = mCallback;
+        mMaxEntries = maxEntries;
+        mMaxBytes = maxBytes;
+        mIdleTtl = idleTtl;
+        evict( &evicted, 0 );
+      }
+      notify( callback, evicted );
+    }
+
+    /** Set limits from settings under /qgis/auth/cache/ (max_entries, max_bytes, idle_ttl) */
+    void setLimitsFromSettings()
+    {
+      QSettings settings;
+      setLimits( settings.value( "/qgis/auth/cache/max_entries", 500 ).toInt(),
+                 settings.value( "/qgis/auth/cache/max_bytes", 16 * 1024 * 1024 ).toLongLong(),
+                 settings.value( "/qgis/auth/cache/idle_ttl", 3600 ).toInt() );
+    }
+
+    void setEvictionCallback( EvictionCallback callback )
+    {
+      QWriteLocker locker( &mLock );
+      mCallback = callback;
+    }
+
+    /**
+     * Look up an entry, marking it as recently used
+     * @return Whether found and not expired
+     */
+    bool lookup( const QString& key, T *value )
+    {
+      bool expired = false;
+      {
+        QReadLocker locker( &mLock );
+        typename QHash<QString, Entry*>::const_iterator it = mEntries.constFind( key );
+        if ( it != mEntries.constEnd() )
+        {
+          Entry *entry = it.value();
+          QMutexLocker statslocker( &mStatsMutex );
+          expired = isExpired( entry );
+          if ( !expired )
+          {
+            entry->lastTick = mTick++;
+            entry->lastUsed = nowSecs();
+            ++mHits;
+            statslocker.unlock();
+            if ( value )
+              *value = entry->value;
+            return true;
+          }
+        }
+        QMutexLocker statslocker( &mStatsMutex );
+        ++mMisses;
+      }
+
+      if ( expired )
+        purge();
+      return false;
+    }
+
+    /**
+     * Insert or replace an entry, evicting others as needed
+     * @param cost Approximate size in bytes, counted against max bytes
+     */
+    void insert( const QString& key, const T& value, int cost = 0 )
+    {
+      Evictions evicted;
+      EvictionCallback callback;
+      {
+        QWriteLocker locker( &mLock );
+        callback = mCallback;
+        removeEntry( key );
+        Entry *entry = new Entry( value, cost );
+        {
+          QMutexLocker statslocker( &mStatsMutex );
+          entry->lastTick = mTick++;
+        }
+        entry->lastUsed = nowSecs();
+        mEntries.insert( key, entry );
+        mBytes += cost;
+        evict( &evicted, entry );
+      }
+      notify( callback, evicted );
+    }
+
+    /** Remove an entry, e.g. after its config was edited
+     * @return Whether it was cached
+     */
+    bool remove( const QString& key )
+    {
+      QWriteLocker locker( &mLock );
+      return removeEntry( key );
+    }
+
+    void clear()
+    {
+      QWriteLocker locker( &mLock );
+      qDeleteAll( mEntries );
+      mEntries.clear();
+      mBytes = 0;
+    }
+
+    /** Size and counters, after purging expired entries */
+    QgsAuthCacheStats stats()
+    {
+      purge();
+      QReadLocker locker( &mLock );
+      QgsAuthCacheStats stats;
+      stats.entries = mEntries.size();
+      stats.bytes = mBytes;
+      QMutexLocker statslocker( &mStatsMutex );
+      stats.hits = mHits;
+      stats.misses = mMisses;
+      stats.evictions = mEvictions;
+      return stats;
+    }
+
+    /** Remove expired entries */
+    void purge()
+    {
+      Evictions evicted;
+      EvictionCallback callback;
+      {
+        QWriteLocker locker( &mLock );
+        callback = mCallback;
+        evict( &evicted, 0 );
+      }
+      notify( callback, evicted );
+    }
+
+  private:
+    Q_DISABLE_COPY( QgsAuthCache )
+
+    typedef QList< QPair<QString, EvictionReason> > Evictions;
+
+    struct Entry
+    {
+      Entry( const T& v, int c ) : value( v ), cost( c ), lastTick( 0 ), lastUsed( 0 ) {}
+      T value;
+      int cost;
+      quint64 lastTick; // recency order; with mStatsMutex held, or the write lock
+      qint64 lastUsed; // seconds since epoch, for idle expiry; likewise
+    };
+
+    static qint64 nowSecs()
+    {
+      return QDateTime::currentMSecsSinceEpoch() / 1000;
+    }
+
+    // with mStatsMutex held, or the write lock
+    bool isExpired( const Entry *entry ) const
+    {
+      return mIdleTtl > 0 && nowSecs() - entry->lastUsed > mIdleTtl;
+    }
+
+    bool removeEntry( const QString& key )
+    {
+      Entry *entry = mEntries.take( key );
+      if ( !entry )
+        return false;
+      mBytes -= entry->cost;
+      delete entry;
+      return true;
+    }
+
+    // with write lock held; never evicts 'keep', the entry just inserted
+    void evict( Evictions *evicted, const Entry *keep )
+    {
+      typename QHash<QString, Entry*>::iterator it = mEntries.begin();
+      while ( it != mEntries.end() )
+      {
+        if ( it.value() != keep && isExpired( it.value() ) )
+        {
+          evicted->append( qMakePair( it.key(), Expired ) );
+          mBytes -= it.value()->cost;
+          delete it.value();
+          it = mEntries.erase( it );
+          ++mEvictions;
+        }
+        else
+        {
+          ++it;
+        }
+      }
+
+      while (( mMaxEntries > 0 && mEntries.size() > mMaxEntries )
+             || ( mMaxBytes > 0 && mBytes > mMaxBytes && mEntries.size() > 1 ) )
+      {
+        // least recently used; linear, but only on insert, which is the cold path
+        typename QHash<QString, Entry*>::iterator lru = mEntries.end();
+        for ( it = mEntries.begin(); it != mEntries.end(); ++it )
+        {
+          if ( it.value() == keep )
+            continue;
+          if ( lru == mEntries.end() || it.value()->lastTick < lru.value()->lastTick )
+            lru = it;
+        }
+        if ( lru == mEntries.end() )
+          break;
+        evicted->append( qMakePair( lru.key(), Capacity ) );
+        mBytes -= lru.value()->cost;
+        delete lru.value();
+        mEntries.erase( lru );
+        ++mEvictions;
+      }
+    }
+
+    void notify( EvictionCallback callback, const Evictions& evicted ) const
+    {
+      if ( !callback )
+        return;
+      for ( int i = 0; i < evicted.size(); ++i )
+      {
+        callback( mName, evicted.at( i ).first, evicted.at( i ).second );
+      }
+    }
+
+    QString mName;
+    int mMaxEntries;
+    qint64 mMaxBytes;
+    int mIdleTtl;
+    qint64 mBytes;
+    QHash<QString, Entry*> mEntries;
+    mutable QReadWriteLock mLock;
+
+    // recency and counters, updated by concurrent lookups under the read lock
+    mutable QMutex mStatsMutex;
+    quint64 mTick;
+    quint64 mHits;
+    quint64 mMisses;
+    quint64 mEvictions;
+
+    EvictionCallback mCallback;
+};
+
+#endif // QGSAUTHENTICATIONCACHE_H
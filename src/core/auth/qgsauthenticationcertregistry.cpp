@@ -0,0 +1,308 @@
+/***************************************************************************
+    qgsauthenticationcertregistry.cpp
+    ---------------------
+    begin                : October 17, 2026
+    copyright            : (C) 2026 by QGIS Development Team
+    author               : QGIS Development Team
+    email                : qgis-developer at lists dot osgeo dot org
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "qgsauthenticationcertregistry.h"
+
+#include <QStringList>
+
+#include "qgsauthenticationmanager.h"
+#include "qgslogger.h"
+
+// past this many mapped handles (copies of certs not sharing data), mappings are dropped
+static const int sMaxHandles = 8192;
+
+static QString resolveName_( const QSslCertificate &cert, bool issuer )
+{
+  QString name( issuer ? cert.issuerInfo( QSslCertificate::CommonName )
+                       : cert.subjectInfo( QSslCertificate::CommonName ) );
+
+  if ( name.isEmpty() )
+    name = issuer ? cert.issuerInfo( QSslCertificate::OrganizationalUnitName )
+                  : cert.subjectInfo( QSslCertificate::OrganizationalUnitName );
+
+  if ( name.isEmpty() )
+    name = issuer ? cert.issuerInfo( QSslCertificate::Organization )
+                  : cert.subjectInfo( QSslCertificate::Organization );
+
+  if ( name.isEmpty() )
+    name = issuer ? cert.issuerInfo( QSslCertificate::LocalityName )
+                  : cert.subjectInfo( QSslCertificate::LocalityName );
+
+  if ( name.isEmpty() )
+    name = issuer ? cert.issuerInfo( QSslCertificate::StateOrProvinceName )
+                  : cert.subjectInfo( QSslCertificate::StateOrProvinceName );
+
+  if ( name.isEmpty() )
+    name = issuer ? cert.issuerInfo( QSslCertificate::CountryName )
+                  : cert.subjectInfo( QSslCertificate::CountryName );
+
+  return name;
+}
+
+static void appendDirSegment_( QStringList &dirname, const QString& segment, QString value )
+{
+  if ( !value.isEmpty() )
+  {
+    dirname.append( segment + "=" + value.replace( ",", "\\," ) );
+  }
+}
+
+static QString distinguishedName_( const QSslCertificate &qcert, const QCA::Certificate &acert, bool issuer )
+{
+  //  E=testcert@boundlessgeo.com,
+  //  CN=Boundless Test Root CA,
+  //  OU=Certificate Authority,
+  //  O=Boundless Test CA,
+  //  L=District of Columbia,
+  //  ST=Washington\, DC,
+  //  C=US
+  QStringList dirname;
+  appendDirSegment_(
+      dirname, "E", issuer ? acert.issuerInfo().value( QCA::Email )
+                           : acert.subjectInfo().value( QCA::Email ) );
+  appendDirSegment_(
+      dirname, "CN", issuer ? qcert.issuerInfo( QSslCertificate::CommonName )
+                            : qcert.subjectInfo( QSslCertificate::CommonName ) );
+  appendDirSegment_(
+      dirname, "OU", issuer ? qcert.issuerInfo( QSslCertificate::OrganizationalUnitName )
+                            : qcert.subjectInfo( QSslCertificate::OrganizationalUnitName ) );
+  appendDirSegment_(
+      dirname, "O", issuer ? qcert.issuerInfo( QSslCertificate::Organization )
+                           : qcert.subjectInfo( QSslCertificate::Organization ) );
+  appendDirSegment_(
+      dirname, "L", issuer ? qcert.issuerInfo( QSslCertificate::LocalityName )
+                           : qcert.subjectInfo( QSslCertificate::LocalityName ) );
+  appendDirSegment_(
+      dirname, "ST", issuer ? qcert.issuerInfo( QSslCertificate::StateOrProvinceName )
+                            : qcert.subjectInfo( QSslCertificate::StateOrProvinceName ) );
+  appendDirSegment_(
+      dirname, "C", issuer ? qcert.issuerInfo( QSslCertificate::CountryName )
+                           : qcert.subjectInfo( QSslCertificate::CountryName ) );
+
+  return dirname.join( "," );
+}
+
+QgsAuthCertEntry::QgsAuthCertEntry( const QSslCertificate &cert )
+    : mCert( cert )
+    , mDigest( cert.digest( QCryptographicHash::Sha1 ) )
+    , mShaHex( mDigest.toHex() )
+    , mOrgLoaded( false )
+    , mValid( false )
+    , mValidLoaded( false )
+    , mConstraintUsagesLoaded( false )
+    , mQcaCertLoaded( false )
+    , mUsagesGeneration( -1 )
+{
+  mResolvedNameLoaded[0] = mResolvedNameLoaded[1] = false;
+  mDistinguishedNameLoaded[0] = mDistinguishedNameLoaded[1] = false;
+}
+
+const QString QgsAuthCertEntry::organization() const
+{
+  QMutexLocker locker( &mLock );
+  if ( !mOrgLoaded )
+  {
+    mOrganization = mCert.subjectInfo( QSslCertificate::Organization );
+    mOrgLoaded = true;
+  }
+  return mOrganization;
+}
+
+const QString QgsAuthCertEntry::resolvedName( bool issuer ) const
+{
+  QMutexLocker locker( &mLock );
+  int i = issuer ? 1 : 0;
+  if ( !mResolvedNameLoaded[i] )
+  {
+    mResolvedName[i] = resolveName_( mCert, issuer );
+    mResolvedNameLoaded[i] = true;
+  }
+  return mResolvedName[i];
+}
+
+const QString QgsAuthCertEntry::distinguishedName( bool issuer ) const
+{
+  QMutexLocker locker( &mLock );
+  int i = issuer ? 1 : 0;
+  if ( !mDistinguishedNameLoaded[i] )
+  {
+    if ( !loadQcaCertificate() )
+      return QString();
+    mDistinguishedName[i] = distinguishedName_( mCert, mQcaCert, issuer );
+    mDistinguishedNameLoaded[i] = true;
+  }
+  return mDistinguishedName[i];
+}
+
+bool QgsAuthCertEntry::isValid() const
+{
+  QMutexLocker locker( &mLock );
+  QDateTime now( QDateTime::currentDateTime() );
+  if ( !mValidLoaded || ( !mValidRecheck.isNull() && now >= mValidRecheck ) )
+  {
+    mValid = mCert.isValid();
+    // validity only changes when crossing effective or expiry date
+    if ( mValid )
+      mValidRecheck = mCert.expiryDate();
+    else if ( now < mCert.effectiveDate() )
+      mValidRecheck = mCert.effectiveDate();
+    else
+      mValidRecheck = QDateTime();
+    mValidLoaded = true;
+  }
+  return mValid;
+}
+
+const QList<QgsAuthCertUtils::CertUsageType> QgsAuthCertEntry::constraintUsages() const
+{
+  QMutexLocker locker( &mLock );
+  if ( !mConstraintUsagesLoaded )
+  {
+    if ( !loadQcaCertificate() )
+      return QList<QgsAuthCertUtils::CertUsageType>();
+
+    if ( mQcaCert.isCA() )
+    {
+      QgsDebugMsg( "Certificate has 'CA:TRUE' basic constraint" );
+      mConstraintUsages << QgsAuthCertUtils::CertAuthorityUsage;
+    }
+
+    QList<QCA::ConstraintType> certconsts = mQcaCert.constraints();
+    Q_FOREACH( QCA::ConstraintType certconst, certconsts )
+    {
+      if ( certconst.known() == QCA::KeyCertificateSign )
+      {
+        QgsDebugMsg( "Certificate has 'Certificate Sign' key usage" );
+        mConstraintUsages << QgsAuthCertUtils::CertIssuerUsage;
+      }
+      else if ( certconst.known() == QCA::ServerAuth )
+      {
+        QgsDebugMsg( "Certificate has 'server authentication' extended key usage" );
+        mConstraintUsages << QgsAuthCertUtils::TlsServerUsage;
+      }
+    }
+    mConstraintUsagesLoaded = true;
+  }
+  return mConstraintUsages;
+}
+
+const QCA::Certificate QgsAuthCertEntry::qcaCertificate() const
+{
+  QMutexLocker locker( &mLock );
+  if ( !loadQcaCertificate() )
+    return QCA::Certificate();
+  return mQcaCert;
+}
+
+bool QgsAuthCertEntry::usages( int generation, QList<QgsAuthCertUtils::CertUsageType> *usages ) const
+{
+  QMutexLocker locker( &mLock );
+  if ( mUsagesGeneration != generation )
+    return false;
+  *usages = mUsages;
+  return true;
+}
+
+void QgsAuthCertEntry::setUsages( int generation, const QList<QgsAuthCertUtils::CertUsageType>& usages )
+{
+  QMutexLocker locker( &mLock );
+  mUsages = usages;
+  mUsagesGeneration = generation;
+}
+
+bool QgsAuthCertEntry::loadQcaCertificate() const
+{
+  // with mLock held
+  if ( mQcaCertLoaded )
+    return !mQcaCert.isNull();
+
+  // not cached, as QCA is not initialized until the auth system is
+  if ( QgsAuthManager::instance()->isDisabled() )
+    return false;
+
+  QCA::ConvertResult res;
+  mQcaCert = QCA::Certificate::fromDER( mCert.toDer(), &res, QString( "qca-ossl" ) );
+  if ( res != QCA::ConvertGood || mQcaCert.isNull() )
+  {
+    QgsDebugMsg( "Certificate could not be converted to QCA cert" );
+    mQcaCert = QCA::Certificate();
+  }
+  mQcaCertLoaded = true;
+  return !mQcaCert.isNull();
+}
+
+QgsAuthCertRegistry *QgsAuthCertRegistry::instance()
+{
+  static QgsAuthCertRegistry sRegistry;
+  return &sRegistry;
+}
+
+QgsAuthCertHandle QgsAuthCertRegistry::intern( const QSslCertificate &cert )
+{
+  if ( cert.isNull() )
+    return QgsAuthCertHandle();
+
+  Qt::HANDLE handle = cert.handle();
+  {
+    QReadLocker locker( &mLock );
+    QHash<Qt::HANDLE, HandleEntry>::const_iterator it = mHandles.constFind( handle );
+    if ( it != mHandles.constEnd() )
+      return it.value().entry;
+  }
+
+  // new data: hash it (outside of lock), then find or add by digest
+  QgsAuthCertHandle newentry( new QgsAuthCertEntry( cert ) );
+
+  QWriteLocker locker( &mLock );
+  if ( mHandles.size() >= sMaxHandles )
+  {
+    QgsDebugMsg( QString( "Certificate registry handles DROPPED: over %1" ).arg( sMaxHandles ) );
+    mHandles.clear();
+    mEntries.clear();
+  }
+
+  QgsAuthCertHandle entry( mEntries.value( newentry->digest() ) );
+  if ( entry.isNull() )
+  {
+    entry = newentry;
+    mEntries.insert( entry->digest(), entry );
+  }
+
+  HandleEntry handleentry;
+  handleentry.cert = cert;
+  handleentry.entry = entry;
+  mHandles.insert( handle, handleentry );
+  return entry;
+}
+
+QgsAuthCertHandle QgsAuthCertRegistry::entry( const QByteArray &digest ) const
+{
+  QReadLocker locker( &mLock );
+  return mEntries.value( digest );
+}
+
+int QgsAuthCertRegistry::size() const
+{
+  QReadLocker locker( &mLock );
+  return mEntries.size();
+}
+
+void QgsAuthCertRegistry::clear()
+{
+  QWriteLocker locker( &mLock );
+  mHandles.clear();
+  mEntries.clear();
+}
@@ -0,0 +1,149 @@
+/***************************************************************************
+    qgsauthenticationcertregistry.h
+    ---------------------
+    begin                : October 17, 2026
+    copyright            : (C) 2026 by QGIS Development Team
+    author               : QGIS Development Team
+    email                : qgis-developer at lists dot osgeo dot org
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef QGSAUTHENTICATIONCERTREGISTRY_H
+#define QGSAUTHENTICATIONCERTREGISTRY_H
+
+#include <QtCrypto>
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QSslCertificate>
+
+#include "qgsauthenticationcertutils.h"
+
+/** \ingroup core
+ * \brief A certificate interned in QgsAuthCertRegistry, with its digest and lazily computed metadata
+ * \note Metadata is computed on first use and shared by all holders of the entry
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthCertEntry
+{
+  public:
+    explicit QgsAuthCertEntry( const QSslCertificate& cert );
+
+    const QSslCertificate& certificate() const { return mCert; }
+
+    /** Binary sha1 digest (20 bytes) */
+    const QByteArray& digest() const { return mDigest; }
+
+    /** Hex sha1 digest, as used for ids in the authentication database */
+    const QString& shaHex() const { return mShaHex; }
+
+    /** Subject organization, empty if not defined */
+    const QString organization() const;
+
+    /** General name via RFC 5280 resolution */
+    const QString resolvedName( bool issuer = false ) const;
+
+    /** Combined directory name */
+    const QString distinguishedName( bool issuer = false ) const;
+
+    /** Whether currently within validity dates and not blacklisted */
+    bool isValid() const;
+
+    /** Usages declared by the certificate's own constraints (CA, cert sign, TLS server) */
+    const QList<QgsAuthCertUtils::CertUsageType> constraintUsages() const;
+
+    /** Converted QCA certificate, null if conversion failed or auth system is disabled */
+    const QCA::Certificate qcaCertificate() const;
+
+    /**
+     * Get usage types memoised by setUsages
+     * @param generation Trust generation the usages must have been determined for
+     * @return Whether usages were memoised for that generation
+     */
+    bool usages( int generation, QList<QgsAuthCertUtils::CertUsageType> *usages ) const;
+
+    /** Memoise usage types, as validated against the trusted and untrusted CAs of a trust generation */
+    void setUsages( int generation, const QList<QgsAuthCertUtils::CertUsageType>& usages );
+
+  private:
+    Q_DISABLE_COPY( QgsAuthCertEntry )
+
+    bool loadQcaCertificate() const;
+
+    QSslCertificate mCert;
+    QByteArray mDigest;
+    QString mShaHex;
+
+    mutable QMutex mLock;
+    mutable bool mOrgLoaded;
+    mutable QString mOrganization;
+    mutable QString mResolvedName[2];
+    mutable bool mResolvedNameLoaded[2];
+    mutable QString mDistinguishedName[2];
+    mutable bool mDistinguishedNameLoaded[2];
+    mutable bool mValid;
+    mutable QDateTime mValidRecheck; // when validity next changes, null if never
+    mutable bool mValidLoaded;
+    mutable QList<QgsAuthCertUtils::CertUsageType> mConstraintUsages;
+    mutable bool mConstraintUsagesLoaded;
+    mutable QCA::Certificate mQcaCert;
+    mutable bool mQcaCertLoaded;
+    QList<QgsAuthCertUtils::CertUsageType> mUsages;
+    int mUsagesGeneration; // -1 until set
+};
+
+typedef QSharedPointer<QgsAuthCertEntry> QgsAuthCertHandle;
+
+/** \ingroup core
+ * \brief Process-wide registry storing each distinct certificate once, keyed by binary sha1 digest
+ *
+ * Interning a certificate that, or a copy of which (sharing the same handle), was interned before
+ * is a hash lookup, without re-encoding or re-hashing it. QgsAuthCertUtils resolves digests,
+ * names and QCA conversions through here, so repeated calls on the same certs are memoised.
+ * \note Thread-safe
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthCertRegistry
+{
+  public:
+    static QgsAuthCertRegistry *instance();
+
+    /** Get the entry for a certificate, interning it if new
+     * @return Null handle for a null certificate
+     */
+    QgsAuthCertHandle intern( const QSslCertificate& cert );
+
+    /** Get an interned entry by binary sha1 digest, null handle if not interned */
+    QgsAuthCertHandle entry( const QByteArray& digest ) const;
+
+    /** Number of distinct certificates interned */
+    int size() const;
+
+    /** Drop all entries; handles already given out stay usable */
+    void clear();
+
+  private:
+    QgsAuthCertRegistry() {}
+    Q_DISABLE_COPY( QgsAuthCertRegistry )
+
+    // a certificate copy keeps its handle alive, so it can't be reused by another cert while mapped
+    struct HandleEntry
+    {
+      QSslCertificate cert;
+      QgsAuthCertHandle entry;
+    };
+
+    QHash<QByteArray, QgsAuthCertHandle> mEntries;
+    QHash<Qt::HANDLE, HandleEntry> mHandles;
+    mutable QReadWriteLock mLock;
+};
+
+#endif // QGSAUTHENTICATIONCERTREGISTRY_H
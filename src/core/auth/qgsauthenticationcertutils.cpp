@@ -18,9 +18,16 @@
 
 #include <QColor>
 #include <QFile>
+#include <QMutex>
 #include <QObject>
+#include <QRunnable>
 #include <QSslCertificate>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
 
+#include "qgsauthenticationcertregistry.h"
 #include "qgsauthenticationmanager.h"
 #include "qgslogger.h"
 
@@ -99,7 +106,8 @@ const QMap<QString, QList<QSslCertificate> > QgsAuthCertUtils::certsGroupedByOrg
   QMap< QString, QList<QSslCertificate> > orgcerts;
   Q_FOREACH( QSslCertificate cert, certs )
   {
-    QString org( cert.subjectInfo( QSslCertificate::Organization ) );
+    QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+    QString org( entry ? entry->organization() : QString() );
     if ( org.isEmpty() )
       org = "(Organization not defined)";
     QList<QSslCertificate> valist = orgcerts.contains( org ) ? orgcerts.value( org ) : QList<QSslCertificate>();
@@ -123,7 +131,8 @@ const QMap<QString, QList<QgsAuthConfigSslServer> > QgsAuthCertUtils::sslConfigs
   QMap< QString, QList<QgsAuthConfigSslServer> > orgconfigs;
   Q_FOREACH( QgsAuthConfigSslServer config, configs )
   {
-    QString org( config.sslCertificate().subjectInfo( QSslCertificate::Organization ) );
+    QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( config.sslCertificate() ) );
+    QString org( entry ? entry->organization() : QString() );
     if ( org.isEmpty() )
       org = QObject::tr( "(Organization not defined)" );
     QList<QgsAuthConfigSslServer> valist = orgconfigs.contains( org ) ? orgconfigs.value( org ) : QList<QgsAuthConfigSslServer>();
@@ -151,11 +160,16 @@ static QByteArray fileData_( const QString& path, bool astext = false )
   return data;
 }
 
+static bool appendCerts_( const QList<QSslCertificate>& certs, void *context )
+{
+  *static_cast< QList<QSslCertificate>* >( context ) << certs;
+  return true;
+}
+
 const QList<QSslCertificate> QgsAuthCertUtils::certsFromFile( const QString &certspath )
 {
   QList<QSslCertificate> certs;
-  bool pem = certspath.endsWith( ".pem", Qt::CaseInsensitive );
-  certs = QSslCertificate::fromData( fileData_( certspath, pem ), pem ? QSsl::Pem : QSsl::Der );
+  certsFromFile( certspath, appendCerts_, &certs );
   if ( certs.isEmpty() )
   {
     QgsDebugMsg( QString( "Parsed cert(s) EMPTY for path: %1" ).arg( certspath ) );
@@ -163,6 +177,369 @@ const QList<QSslCertificate> QgsAuthCertUtils::certsFromFile( const QString &cer
   return certs;
 }
 
+// PEM blocks decoded per task, and the most decoded before they are handed to the receiver
+static const int sPemDecodeBatch = 64;
+
+// offset and length of each PEM certificate block, found without copying data
+static QList< QPair<int, int> > pemCertBlocks_( const QByteArray& data )
+{
+  static const QByteArray begin( "-----BEGIN CERTIFICATE-----" );
+  static const QByteArray end( "-----END CERTIFICATE-----" );
+
+  QList< QPair<int, int> > blocks;
+  int pos = 0;
+  while (( pos = data.indexOf( begin, pos ) ) >= 0 )
+  {
+    int endpos = data.indexOf( end, pos + begin.size() );
+    if ( endpos < 0 )
+    {
+      QgsDebugMsg( QString( "PEM certificate block at %1 is truncated" ).arg( pos ) );
+      break;
+    }
+    endpos += end.size();
+    blocks << qMakePair( pos, endpos - pos );
+    pos = endpos;
+  }
+  return blocks;
+}
+
+// decodes a batch of PEM certificate blocks, on a worker thread
+class QgsAuthCertsDecodeTask : public QRunnable
+{
+  public:
+    QgsAuthCertsDecodeTask( const QByteArray& data, const QList< QPair<int, int> >& blocks, QList<QSslCertificate> *certs )
+        : mData( data ), mBlocks( blocks ), mCerts( certs ) {}
+
+    void run()
+    {
+      for ( int i = 0; i < mBlocks.size(); ++i )
+      {
+        // view of the block; decoding copies what it needs
+        QSslCertificate cert( QByteArray::fromRawData( mData.constData() + mBlocks.at( i ).first, mBlocks.at( i ).second ), QSsl::Pem );
+        if ( cert.isNull() )
+        {
+          QgsDebugMsg( QString( "PEM certificate block at %1 could not be decoded" ).arg( mBlocks.at( i ).first ) );
+          continue;
+        }
+        mCerts->append( cert );
+      }
+    }
+
+  private:
+    QByteArray mData;
+    QList< QPair<int, int> > mBlocks;
+    QList<QSslCertificate> *mCerts;
+};
+
+int QgsAuthCertUtils::certsFromFile( const QString &certspath, CertsReceiver receiver, void *context )
+{
+  QFile file( certspath );
+  if ( !file.open( QIODevice::ReadOnly ) )
+  {
+    QgsDebugMsg( QString( "Certs file could not be opened: %1" ).arg( certspath ) );
+    return 0;
+  }
+  qint64 size = file.size();
+  if ( size <= 0 || size >= (( qint64 )1 << 31 ) )
+  {
+    QgsDebugMsg( QString( "Certs file empty or too large: %1" ).arg( certspath ) );
+    return 0;
+  }
+
+  // mapped when possible, rather than read; stays valid until file is closed
+  QByteArray data;
+  uchar *mapped = file.map( 0, size );
+  if ( mapped )
+    data = QByteArray::fromRawData(( const char * )mapped, ( int )size );
+  else
+    data = file.readAll();
+
+  if ( !isPemData( data ) )
+  {
+    QList<QSslCertificate> certs( QSslCertificate::fromData( data, QSsl::Der ) );
+    if ( !certs.isEmpty() )
+      receiver( certs, context );
+    return certs.size();
+  }
+
+  QList< QPair<int, int> > blocks( pemCertBlocks_( data ) );
+  int delivered = 0;
+
+  if ( blocks.size() <= sPemDecodeBatch )
+  {
+    QList<QSslCertificate> certs;
+    QgsAuthCertsDecodeTask( data, blocks, &certs ).run();
+    if ( !certs.isEmpty() )
+      receiver( certs, context );
+    return certs.size();
+  }
+
+  // large bundles: decode batches across cores, handing them over in file order as each wave completes
+  QThreadPool pool;
+  int threads = qMax( 1, QThread::idealThreadCount() );
+  pool.setMaxThreadCount( threads );
+  int wave = threads * sPemDecodeBatch;
+
+  for ( int start = 0; start < blocks.size(); start += wave )
+  {
+    int batches = ( qMin( wave, blocks.size() - start ) + sPemDecodeBatch - 1 ) / sPemDecodeBatch;
+    QVector< QList<QSslCertificate> > results( batches );
+    for ( int i = 0; i < batches; ++i )
+    {
+      pool.start( new QgsAuthCertsDecodeTask( data, blocks.mid( start + i * sPemDecodeBatch, sPemDecodeBatch ), &results[i] ) );
+    }
+    pool.waitForDone();
+
+    for ( int i = 0; i < batches; ++i )
+    {
+      if ( results.at( i ).isEmpty() )
+        continue;
+      delivered += results.at( i ).size();
+      if ( !receiver( results.at( i ), context ) )
+      {
+        QgsDebugMsg( QString( "Parsing certs STOPPED by receiver after %1 of %2 blocks: %3" )
+                     .arg( start + ( i + 1 ) * sPemDecodeBatch ).arg( blocks.size() ).arg( certspath ) );
+        return delivered;
+      }
+    }
+  }
+
+  QgsDebugMsg( QString( "Parsed %1 of %2 PEM cert blocks in %3 threads: %4" )
+               .arg( delivered ).arg( blocks.size() ).arg( threads ).arg( certspath ) );
+  return delivered;
+}
+
+bool QgsAuthCertUtils::isPemData( const QByteArray& data )
+{
+  // DER certs and keys are a SEQUENCE, whose content may happen to contain the marker;
+  // PEM may be preceded by text, e.g. bag attributes or comments in CA bundles
+  if ( data.isEmpty() || data.at( 0 ) == 0x30 )
+    return false;
+  return data.contains( "-----BEGIN " );
+}
+
+// DER tag and length at pos; returns size of header, or 0 if malformed or truncated
+static int derHeader_( const QByteArray& der, int pos, int *tag, int *len )
+{
+  if ( pos < 0 || pos + 2 > der.size() )
+    return 0;
+
+  *tag = ( unsigned char )der.at( pos );
+  int first = ( unsigned char )der.at( pos + 1 );
+  int hdr = 2;
+  if ( first < 0x80 )
+  {
+    *len = first;
+  }
+  else
+  {
+    // long form: low bits give number of length bytes that follow
+    int n = first & 0x7f;
+    if ( n == 0 || n > 3 || pos + 2 + n > der.size() )
+      return 0;
+    *len = 0;
+    for ( int i = 0; i < n; ++i )
+      *len = ( *len << 8 ) | ( unsigned char )der.at( pos + 2 + i );
+    hdr += n;
+  }
+  return ( pos + hdr + *len <= der.size() ) ? hdr : 0;
+}
+
+// key algorithm of a DER private key, and whether it is PKCS#8 (encrypted or not)
+static QString derKeyAlgorithm_( const QByteArray& der, bool *pkcs8, bool *encrypted )
+{
+  // DER of key type OIDs: rsaEncryption, id-dsa and id-ecPublicKey
+  static const QByteArray rsaoid( "\x2a\x86\x48\x86\xf7\x0d\x01\x01\x01", 9 );
+  static const QByteArray dsaoid( "\x2a\x86\x48\xce\x38\x04\x01", 7 );
+  static const QByteArray ecoid( "\x2a\x86\x48\xce\x3d\x02\x01", 7 );
+
+  *pkcs8 = false;
+  *encrypted = false;
+
+  int tag, len;
+  int hdr = derHeader_( der, 0, &tag, &len );
+  if ( !hdr || tag != 0x30 )
+    return QString();
+  int pos = hdr;
+  int end = hdr + len;
+
+  hdr = derHeader_( der, pos, &tag, &len );
+  if ( !hdr )
+    return QString();
+  if ( tag == 0x30 )
+  {
+    // EncryptedPrivateKeyInfo: algorithm is only known once decrypted
+    *pkcs8 = true;
+    *encrypted = true;
+    return QString();
+  }
+  if ( tag != 0x02 )
+    return QString();
+
+  // skip version
+  pos += hdr + len;
+  hdr = derHeader_( der, pos, &tag, &len );
+  if ( !hdr )
+    return QString();
+
+  if ( tag == 0x30 )
+  {
+    // PrivateKeyInfo: AlgorithmIdentifier starts with key type OID
+    *pkcs8 = true;
+    int oidtag, oidlen;
+    int oidhdr = derHeader_( der, pos + hdr, &oidtag, &oidlen );
+    if ( !oidhdr || oidtag != 0x06 )
+      return QString();
+    QByteArray oid( der.mid( pos + hdr + oidhdr, oidlen ) );
+    if ( oid == rsaoid )
+      return "rsa";
+    if ( oid == dsaoid )
+      return "dsa";
+    if ( oid == ecoid )
+      return "ec";
+    return QString();
+  }
+  if ( tag == 0x04 )
+  {
+    // RFC 5915 ECPrivateKey: version, then private key octet string
+    return "ec";
+  }
+  if ( tag == 0x02 )
+  {
+    // PKCS#1 RSAPrivateKey has 9 integers, traditional DSA key 6
+    int ints = 1;
+    while ( pos < end )
+    {
+      hdr = derHeader_( der, pos, &tag, &len );
+      if ( !hdr || tag != 0x02 )
+        return QString();
+      ++ints;
+      pos += hdr + len;
+    }
+    if ( ints == 9 )
+      return "rsa";
+    if ( ints == 6 )
+      return "dsa";
+  }
+  return QString();
+}
+
+static QByteArray pemFromDer_( const QByteArray& der, const QByteArray& label )
+{
+  QByteArray b64( der.toBase64() );
+  QByteArray pem( "-----BEGIN " + label + "-----\n" );
+  for ( int i = 0; i < b64.size(); i += 64 )
+  {
+    pem += b64.mid( i, 64 ) + '\n';
+  }
+  pem += "-----END " + label + "-----\n";
+  return pem;
+}
+
+QSslKey QgsAuthCertUtils::keyFromData( const QByteArray& keydata, const QString& keypass, QString *algtype )
+{
+  if ( keydata.isEmpty() )
+    return QSslKey();
+
+  bool pem = isPemData( keydata );
+  QByteArray data( keydata );
+  QString alg;
+
+  if ( pem )
+  {
+    // first key block, since a file may also hold certs
+    int start = 0;
+    QByteArray label;
+    while ( ( start = keydata.indexOf( "-----BEGIN ", start ) ) != -1 )
+    {
+      start += 11;
+      label = keydata.mid( start, keydata.indexOf( "-----", start ) - start );
+      if ( label.endsWith( "PRIVATE KEY" ) )
+        break;
+    }
+    if ( start == -1 )
+      return QSslKey();
+
+    if ( label == "RSA PRIVATE KEY" )
+    {
+      alg = "rsa";
+    }
+    else if ( label == "DSA PRIVATE KEY" )
+    {
+      alg = "dsa";
+    }
+    else if ( label == "EC PRIVATE KEY" )
+    {
+      alg = "ec";
+    }
+    else if ( label == "PRIVATE KEY" )
+    {
+      int body = keydata.indexOf( '\n', start ) + 1;
+      QByteArray der( QByteArray::fromBase64( keydata.mid( body, keydata.indexOf( "-----END", body ) - body ) ) );
+      bool pkcs8, encrypted;
+      alg = derKeyAlgorithm_( der, &pkcs8, &encrypted );
+    }
+    // else ENCRYPTED PRIVATE KEY, whose algorithm is only known once decrypted
+  }
+  else
+  {
+    bool pkcs8, encrypted;
+    alg = derKeyAlgorithm_( keydata, &pkcs8, &encrypted );
+    if ( pkcs8 )
+    {
+      // QSslKey only reads PKCS#1 and traditional keys as DER, but PKCS#8 as PEM
+      data = pemFromDer_( keydata, encrypted ? "ENCRYPTED PRIVATE KEY" : "PRIVATE KEY" );
+      pem = true;
+    }
+  }
+
+  QStringList algs;
+  if ( !alg.isEmpty() )
+    algs << alg;
+  else
+    algs << "rsa" << "dsa" << "ec";
+
+  QByteArray passphrase( !keypass.isEmpty() ? keypass.toUtf8() : QByteArray() );
+  Q_FOREACH ( const QString& a, algs )
+  {
+    QSsl::KeyAlgorithm qalg;
+    if ( a == "rsa" )
+    {
+      qalg = QSsl::Rsa;
+    }
+    else if ( a == "dsa" )
+    {
+      qalg = QSsl::Dsa;
+    }
+    else
+    {
+#if QT_VERSION >= 0x050500
+      qalg = QSsl::Ec;
+#else
+      QgsDebugMsg( "EC private keys require Qt 5.5 or later" );
+      continue;
+#endif
+    }
+
+    QSslKey key( data, qalg, pem ? QSsl::Pem : QSsl::Der, QSsl::PrivateKey, passphrase );
+    if ( !key.isNull() )
+    {
+      if ( algtype )
+        *algtype = a;
+      return key;
+    }
+  }
+
+  QgsDebugMsg( QString( "Private key could not be read (%1, algorithm %2)" )
+               .arg( pem ? "PEM" : "DER" ).arg( !alg.isEmpty() ? alg : "unknown" ) );
+  return QSslKey();
+}
+
+QSslKey QgsAuthCertUtils::keyFromFile( const QString& keypath, const QString& keypass, QString *algtype )
+{
+  return keyFromData( fileData_( keypath ), keypass, algtype );
+}
+
 const QList<QSslCertificate> QgsAuthCertUtils::certsFromString( const QString &pemtext )
 {
   QList<QSslCertificate> certs;
@@ -200,90 +577,28 @@ const QString QgsAuthCertUtils::getCaSourceName( QgsAuthCertUtils::CaCertSource
 
 const QString QgsAuthCertUtils::resolvedCertName( const QSslCertificate &cert, bool issuer )
 {
-  QString name( issuer ? cert.issuerInfo( QSslCertificate::CommonName )
-                       : cert.subjectInfo( QSslCertificate::CommonName ) );
-
-  if ( name.isEmpty() )
-    name = issuer ? cert.issuerInfo( QSslCertificate::OrganizationalUnitName )
-                  : cert.subjectInfo( QSslCertificate::OrganizationalUnitName );
-
-  if ( name.isEmpty() )
-    name = issuer ? cert.issuerInfo( QSslCertificate::Organization )
-                  : cert.subjectInfo( QSslCertificate::Organization );
-
-  if ( name.isEmpty() )
-    name = issuer ? cert.issuerInfo( QSslCertificate::LocalityName )
-                  : cert.subjectInfo( QSslCertificate::LocalityName );
-
-  if ( name.isEmpty() )
-    name = issuer ? cert.issuerInfo( QSslCertificate::StateOrProvinceName )
-                  : cert.subjectInfo( QSslCertificate::StateOrProvinceName );
-
-  if ( name.isEmpty() )
-    name = issuer ? cert.issuerInfo( QSslCertificate::CountryName )
-                  : cert.subjectInfo( QSslCertificate::CountryName );
-
-  return name;
-}
-
-// private
-void QgsAuthCertUtils::appendDirSegment_( QStringList &dirname,
-                                          const QString& segment, QString value )
-{
-  if ( !value.isEmpty() )
-  {
-    dirname.append( segment + "=" + value.replace( ",", "\\," ) );
-  }
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+  return entry ? entry->resolvedName( issuer ) : QString();
 }
 
 const QString QgsAuthCertUtils::getCertDistinguishedName( const QSslCertificate &qcert ,
                                                           const QCA::Certificate &acert ,
                                                           bool issuer )
 {
+  Q_UNUSED( acert );
+  return getCertDistinguishedName( qcert, issuer );
+}
+
+const QString QgsAuthCertUtils::getCertDistinguishedName( const QSslCertificate &qcert, bool issuer )
+{
+  // QCA cert of the registry entry is used, converted once
   if ( QgsAuthManager::instance()->isDisabled() )
     return QString();
 
-  if ( acert.isNull() )
-  {
-    QCA::ConvertResult res;
-    QCA::Certificate acert( QCA::Certificate::fromPEM( qcert.toPem(), &res, QString( "qca-ossl" ) ) );
-    if ( res != QCA::ConvertGood || acert.isNull() )
-    {
-      QgsDebugMsg( "Certificate could not be converted to QCA cert" );
-      return QString();
-    }
-  }
-  //  E=testcert@boundlessgeo.com,
-  //  CN=Boundless Test Root CA,
-  //  OU=Certificate Authority,
-  //  O=Boundless Test CA,
-  //  L=District of Columbia,
-  //  ST=Washington\, DC,
-  //  C=US
-  QStringList dirname;
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "E", issuer ? acert.issuerInfo().value( QCA::Email )
-                             : acert.subjectInfo().value( QCA::Email ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "CN", issuer ? qcert.issuerInfo( QSslCertificate::CommonName )
-                              : qcert.subjectInfo( QSslCertificate::CommonName ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "OU", issuer ? qcert.subjectInfo( QSslCertificate::OrganizationalUnitName )
-                              : qcert.subjectInfo( QSslCertificate::OrganizationalUnitName ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "O", issuer ? qcert.subjectInfo( QSslCertificate::Organization )
-                             : qcert.subjectInfo( QSslCertificate::Organization ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "L", issuer ? qcert.subjectInfo( QSslCertificate::LocalityName )
-                             : qcert.subjectInfo( QSslCertificate::LocalityName ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "ST", issuer ? qcert.subjectInfo( QSslCertificate::StateOrProvinceName )
-                              : qcert.subjectInfo( QSslCertificate::StateOrProvinceName ) );
-  QgsAuthCertUtils::appendDirSegment_(
-        dirname, "C", issuer ? qcert.subjectInfo( QSslCertificate::CountryName )
-                             : qcert.subjectInfo( QSslCertificate::CountryName ) );
-
-  return dirname.join("," );
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( qcert ) );
+  if ( !entry )
+    return QString();
+  return entry->distinguishedName( issuer );
 }
 
 const QString QgsAuthCertUtils::getCertTrustName( QgsAuthCertUtils::CertTrustPolicy trust )
@@ -321,7 +636,8 @@ const QString QgsAuthCertUtils::getColonDelimited( const QString &txt )
 
 const QString QgsAuthCertUtils::shaHexForCert( const QSslCertificate& cert, bool formatted )
 {
-  QString sha( cert.digest( QCryptographicHash::Sha1 ).toHex() );
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+  QString sha( entry ? entry->shaHex() : QString( cert.digest( QCryptographicHash::Sha1 ).toHex() ) );
   if ( formatted )
   {
     return QgsAuthCertUtils::getColonDelimited( sha );
@@ -334,14 +650,8 @@ const QCA::Certificate QgsAuthCertUtils::qtCertToQcaCert( const QSslCertificate
   if ( QgsAuthManager::instance()->isDisabled() )
     return QCA::Certificate();
 
-  QCA::ConvertResult res;
-  QCA::Certificate qcacert( QCA::Certificate::fromPEM( cert.toPem(), &res, QString( "qca-ossl" ) ) );
-  if ( res != QCA::ConvertGood || qcacert.isNull() )
-  {
-    QgsDebugMsg( "Certificate could not be converted to QCA cert" );
-    qcacert = QCA::Certificate();
-  }
-  return qcacert;
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+  return entry ? entry->qcaCertificate() : QCA::Certificate();
 }
 
 const QCA::CertificateCollection QgsAuthCertUtils::qtCertsToQcaCollection( const QList<QSslCertificate> &certs )
@@ -560,6 +870,43 @@ const QString QgsAuthCertUtils::certificateUsageTypeString(QgsAuthCertUtils::Cer
 
 }
 
+// QCA collections of trusted and untrusted CAs, rebuilt when the manager's trust generation changes
+static QMutex sTrustCollectionsMutex;
+static int sTrustCollectionsGeneration = -1;
+static QCA::CertificateCollection sTrustedCollection;
+static QCA::CertificateCollection sUntrustedCollection;
+
+static void trustCollections_( int generation, QCA::CertificateCollection *trusted, QCA::CertificateCollection *untrusted )
+{
+  {
+    QMutexLocker locker( &sTrustCollectionsMutex );
+    if ( sTrustCollectionsGeneration == generation )
+    {
+      *trusted = sTrustedCollection;
+      *untrusted = sUntrustedCollection;
+      return;
+    }
+  }
+
+  // built without holding the mutex, as the manager's cache getters take its own lock
+  *trusted = QgsAuthCertUtils::qtCertsToQcaCollection( QgsAuthManager::instance()->getTrustedCaCertsCache() );
+  *untrusted = QgsAuthCertUtils::qtCertsToQcaCollection( QgsAuthManager::instance()->getUntrustedCaCerts() );
+  QgsDebugMsg( QString( "Rebuilt QCA trust collections for generation %1" ).arg( generation ) );
+
+  QMutexLocker locker( &sTrustCollectionsMutex );
+  sTrustedCollection = *trusted;
+  sUntrustedCollection = *untrusted;
+  sTrustCollectionsGeneration = generation;
+}
+
+void QgsAuthCertUtils::clearTrustCollections()
+{
+  QMutexLocker locker( &sTrustCollectionsMutex );
+  sTrustedCollection = QCA::CertificateCollection();
+  sUntrustedCollection = QCA::CertificateCollection();
+  sTrustCollectionsGeneration = -1;
+}
+
 QList<QgsAuthCertUtils::CertUsageType> QgsAuthCertUtils::certificateUsageTypes( const QSslCertificate &cert )
 {
   QList<QgsAuthCertUtils::CertUsageType> usages;
@@ -567,40 +914,22 @@ QList<QgsAuthCertUtils::CertUsageType> QgsAuthCertUtils::certificateUsageTypes(
   if ( QgsAuthManager::instance()->isDisabled() )
     return usages;
 
-  QCA::ConvertResult res;
-  QCA::Certificate qcacert( QCA::Certificate::fromPEM( cert.toPem(), &res, QString( "qca-ossl" ) ) );
-  if ( res != QCA::ConvertGood || qcacert.isNull() )
-  {
-    QgsDebugMsg( "Certificate could not be converted to QCA cert" );
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+  QCA::Certificate qcacert( entry ? entry->qcaCertificate() : QCA::Certificate() );
+  if ( qcacert.isNull() )
     return usages;
-  }
 
-  if ( qcacert.isCA() )
-  {
-    QgsDebugMsg( "Certificate has 'CA:TRUE' basic constraint" );
-    usages << QgsAuthCertUtils::CertAuthorityUsage;
-  }
+  // validation depends on trusted and untrusted CAs, so results hold for a trust generation
+  int generation = QgsAuthManager::instance()->sslConfigGeneration();
+  if ( entry->usages( generation, &usages ) )
+    return usages;
 
-  QList<QCA::ConstraintType> certconsts = qcacert.constraints();
-  Q_FOREACH( QCA::ConstraintType certconst, certconsts )
-  {
-    if ( certconst.known() == QCA::KeyCertificateSign )
-    {
-      QgsDebugMsg( "Certificate has 'Certificate Sign' key usage" );
-      usages << QgsAuthCertUtils::CertIssuerUsage;
-    }
-    else if ( certconst.known() == QCA::ServerAuth )
-    {
-      QgsDebugMsg( "Certificate has 'server authentication' extended key usage" );
-      usages << QgsAuthCertUtils::TlsServerUsage;
-    }
-  }
+  usages << entry->constraintUsages();
 
   // ask QCA what it thinks about potential usages
-  QCA::CertificateCollection trustedCAs(
-        qtCertsToQcaCollection( QgsAuthManager::instance()->getTrustedCaCertsCache() ) );
-  QCA::CertificateCollection untrustedCAs(
-        qtCertsToQcaCollection( QgsAuthManager::instance()->getUntrustedCaCerts() ) );
+  QCA::CertificateCollection trustedCAs;
+  QCA::CertificateCollection untrustedCAs;
+  trustCollections_( generation, &trustedCAs, &untrustedCAs );
 
   QCA::Validity v_any;
   v_any = qcacert.validate( trustedCAs, untrustedCAs, QCA::UsageAny, QCA::ValidateAll );
@@ -632,6 +961,7 @@ QList<QgsAuthCertUtils::CertUsageType> QgsAuthCertUtils::certificateUsageTypes(
   // TODO: add TlsServerEvUsage, CodeSigningUsage, EmailProtectionUsage, TimeStampingUsage, CRLSigningUsage
   //       as they become necessary, since we do not want the overhead of checking just yet.
 
+  entry->setUsages( generation, usages );
   return usages;
 }
 
@@ -647,14 +977,16 @@ bool QgsAuthCertUtils::certificateIsIssuer( const QSslCertificate &cert )
 
 bool QgsAuthCertUtils::certificateIsAuthorityOrIssuer( const QSslCertificate &cert )
 {
-  return ( QgsAuthCertUtils::certificateIsAuthority( cert )
-           || QgsAuthCertUtils::certificateIsIssuer( cert ) );
+  QList<QgsAuthCertUtils::CertUsageType> usages( certificateUsageTypes( cert ) );
+  return ( usages.contains( QgsAuthCertUtils::CertAuthorityUsage )
+           || usages.contains( QgsAuthCertUtils::CertIssuerUsage ) );
 }
 
 bool QgsAuthCertUtils::certificateIsSslServer( const QSslCertificate &cert )
 {
-  return ( certificateUsageTypes( cert ).contains( QgsAuthCertUtils::TlsServerUsage )
-           || certificateUsageTypes( cert ).contains( QgsAuthCertUtils::TlsServerEvUsage ) );
+  QList<QgsAuthCertUtils::CertUsageType> usages( certificateUsageTypes( cert ) );
+  return ( usages.contains( QgsAuthCertUtils::TlsServerUsage )
+           || usages.contains( QgsAuthCertUtils::TlsServerEvUsage ) );
 }
 
 #if 0
@@ -21,12 +21,13 @@
 #include <QtCrypto>
 #include <QSslCertificate>
 #include <QSslError>
+#include <QSslKey>
 
 #include "qgsauthenticationconfig.h"
 
 /** \ingroup core
  * \brief Utilities for working with certificates and keys
- * \since 2.9
+ * \since 2.8
  */
 class CORE_EXPORT QgsAuthCertUtils
 {
@@ -102,9 +103,47 @@ class CORE_EXPORT QgsAuthCertUtils
     /** Map SSL custom configs' certificates to their oraganization */
     static const QMap< QString, QList<QgsAuthConfigSslServer> > sslConfigsGroupedByOrg( QList<QgsAuthConfigSslServer> configs );
 
-    /** Return list of concatenated certs from a PEM or DER formatted file */
+    /** Return list of concatenated certs from a PEM or DER formatted file (format sniffed from content) */
     static const QList<QSslCertificate> certsFromFile( const QString &certspath );
 
+    /**
+     * Receives certificates parsed from a file, in file order
+     * @return false to stop parsing
+     */
+    typedef bool ( *CertsReceiver )( const QList<QSslCertificate>& certs, void *context );
+
+    /**
+     * Parse certs from a PEM or DER formatted file, handing them to a receiver incrementally
+     * @note File is memory-mapped when possible. PEM blocks are located without copying and, for
+     * large bundles, decoded in batches across cores; each wave of batches goes to the receiver as
+     * it completes, on the calling thread
+     * @param certspath Path to file
+     * @param receiver Called with each batch of certs
+     * @param context Passed through to receiver
+     * @return Number of certs handed to receiver
+     */
+    static int certsFromFile( const QString &certspath, CertsReceiver receiver, void *context = 0 );
+
+    /** Whether data is PEM formatted (Base64 between BEGIN/END lines), rather than binary DER */
+    static bool isPemData( const QByteArray& data );
+
+    /**
+     * Return private key from PEM or DER data, decoded once
+     * @note Handles PKCS#1 RSA, traditional DSA and EC, and PKCS#8 (optionally encrypted) keys.
+     * Format is sniffed from content and algorithm from the PEM label or the ASN.1 structure and
+     * key type OID. EC keys need Qt 5.5 or later
+     * @param keydata PEM or DER data
+     * @param keypass Passphrase of encrypted key
+     * @param algtype Set to "rsa", "dsa" or "ec" on success
+     * @return Null key on failure
+     */
+    static QSslKey keyFromData( const QByteArray& keydata, const QString& keypass = QString(), QString *algtype = 0 );
+
+    /** Return private key from a PEM or DER formatted file
+     * @see keyFromData
+     */
+    static QSslKey keyFromFile( const QString& keypath, const QString& keypass = QString(), QString *algtype = 0 );
+
     /** Return list of concatenated certs from a PEM Base64 text block */
     static const QList<QSslCertificate> certsFromString( const QString &pemtext );
 
@@ -115,8 +154,13 @@ class CORE_EXPORT QgsAuthCertUtils
     static const QString resolvedCertName( const QSslCertificate& cert, bool issuer = false );
 
     /** Get combined directory name for certificate */
+    static const QString getCertDistinguishedName( const QSslCertificate& qcert, bool issuer = false );
+
+    /** Get combined directory name for certificate
+     * @deprecated since 2.8, acert is not used; use getCertDistinguishedName( qcert, issuer )
+     */
     static const QString getCertDistinguishedName( const QSslCertificate& qcert,
-                                                   const QCA::Certificate& acert = QCA::Certificate(),
+                                                   const QCA::Certificate& acert,
                                                    bool issuer = false );
 
     /** Get the general name for certificate trust */
@@ -149,6 +193,11 @@ class CORE_EXPORT QgsAuthCertUtils
     /** Try to determine the certificates usage types */
     static QList<QgsAuthCertUtils::CertUsageType> certificateUsageTypes( const QSslCertificate& cert );
 
+    /** Release the QCA collections of trusted and untrusted CAs that usage types are validated against
+     * @note Called on manager teardown, before QCA is deinitialized
+     */
+    static void clearTrustCollections();
+
     /** Get whether a certificate is an Authority */
     static bool certificateIsAuthority( const QSslCertificate& cert );
 
@@ -166,9 +215,6 @@ class CORE_EXPORT QgsAuthCertUtils
 
     /** Get short strings describing SSL errors */
     static const QList<QPair<QSslError::SslError, QString> > sslErrorEnumStrings();
-
-  private:
-    static void appendDirSegment_( QStringList &dirname, const QString &segment, QString value );
 };
 
 #endif // QGSAUTHCERTUTILS_H
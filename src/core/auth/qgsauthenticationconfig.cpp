@@ -281,9 +281,10 @@ const QStringList QgsAuthConfigPkiPkcs12::keyAsPem( bool reencrypt ) const
   if ( !isValid() )
     return QStringList() << QString() << QString();
 
+  QString algtype;
   QStringList keylist;
-  keylist << QgsAuthProviderPkiPkcs12::keyAsPem( bundlePath(), bundlePassphrase(), reencrypt );
-  keylist << QString( "rsa" );
+  keylist << QgsAuthProviderPkiPkcs12::keyAsPem( bundlePath(), bundlePassphrase(), reencrypt, &algtype );
+  keylist << algtype;
   return keylist;
 }
 
@@ -32,23 +32,55 @@
 #define KEY_GEN_ITERATIONS 10000
 #define KEY_GEN_LENGTH 16
 #define KEY_GEN_IV_LENGTH 16
+#define DATA_KEY_LENGTH 32
+#define WRAP_KEY_LENGTH 32
+#define GCM_SIGNATURE "aes256-gcm"
+#define GCM_MODE QCA::Cipher::GCM
+#define GCM_NONCE_LENGTH 12
+#define GCM_TAG_LENGTH 16
+// envelope header: magic, then format version
+#define ENVELOPE_MAGIC "QGAE"
+#define ENVELOPE_MAGIC_LENGTH 4
+#define ENVELOPE_HEADER_LENGTH ( ENVELOPE_MAGIC_LENGTH + 1 )
+
+bool QgsAuthCrypto::smCipherSupported = false;
+int QgsAuthCrypto::smAuthCipherSupport = -1;
 
 bool QgsAuthCrypto::isDisabled()
 {
+  // provider support does not change once found, so only probe until it is
+  if ( smCipherSupported )
+    return false;
+
   if ( !QCA::isSupported( CIPHER_SIGNATURE, CIPHER_PROVIDER ) )
   {
     qDebug( "Authentication system DISABLED: QCA's qca-ossl (OpenSSL) plugin is missing" );
     return true;
   }
+  smCipherSupported = true;
   return false;
 }
 
+bool QgsAuthCrypto::isAuthenticatedCipherSupported()
+{
+  if ( smAuthCipherSupport < 0 )
+  {
+#if QCA_VERSION >= 0x020100
+    smAuthCipherSupport = QCA::isSupported( GCM_SIGNATURE, CIPHER_PROVIDER ) ? 1 : 0;
+#else
+    smAuthCipherSupport = 0;
+#endif
+    qDebug( "Authenticated cipher (AES-GCM) %s", smAuthCipherSupport ? "supported" : "NOT supported" );
+  }
+  return smAuthCipherSupport == 1;
+}
+
 const QString QgsAuthCrypto::encrypt( QString pass, QString cipheriv, QString text )
 {
   if ( QgsAuthCrypto::isDisabled() )
     return QString();
 
-  return encryptdecrypt( pass, cipheriv, text, true );
+  return encryptdecrypt( QCA::SecureArray( QByteArray( pass.toUtf8().constData() ) ), cipheriv, text, true );
 }
 
 const QString QgsAuthCrypto::decrypt( QString pass, QString cipheriv, QString text )
@@ -56,14 +88,75 @@ const QString QgsAuthCrypto::decrypt( QString pass, QString cipheriv, QString te
   if ( QgsAuthCrypto::isDisabled() )
     return QString();
 
-  return encryptdecrypt( pass, cipheriv, text, false );
+  return encryptdecrypt( QCA::SecureArray( QByteArray( pass.toUtf8().constData() ) ), cipheriv, text, false );
 }
 
-static QCA::SymmetricKey passwordKey_( const QString& pass, const QCA::InitializationVector& salt )
+static QCA::SymmetricKey passwordKey_( const QString& pass, const QCA::InitializationVector& salt,
+                                       unsigned int keylength = KEY_GEN_LENGTH )
 {
   QCA::SecureArray passarray( QByteArray( pass.toUtf8().constData() ) );
   QCA::SecureArray passhash( QCA::Hash( PASSWORD_HASH_ALGORITHM ).hash( passarray ) );
-  return QCA::PBKDF2().makeKey( passhash, salt, KEY_GEN_LENGTH, KEY_GEN_ITERATIONS );
+  return QCA::PBKDF2().makeKey( passhash, salt, keylength, KEY_GEN_ITERATIONS );
+}
+
+void QgsAuthCrypto::generateDataKey( QCA::SecureArray *datakey )
+{
+  if ( QgsAuthCrypto::isDisabled() )
+    return;
+
+  *datakey = QCA::SymmetricKey( DATA_KEY_LENGTH );
+}
+
+const QString QgsAuthCrypto::wrapDataKey( const QString& pass, const QCA::SecureArray& datakey )
+{
+  if ( QgsAuthCrypto::isDisabled() || datakey.isEmpty() )
+    return QString();
+
+  // key-encryption key uses its own salt, so it never matches the stored password hash
+  QCA::InitializationVector keksalt( KEY_GEN_IV_LENGTH );
+  QCA::SymmetricKey kek( passwordKey_( pass, keksalt, WRAP_KEY_LENGTH ) );
+  QCA::InitializationVector wrapiv( KEY_GEN_IV_LENGTH );
+
+  QCA::Cipher cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
+                      QCA::Encode, kek, wrapiv, CIPHER_PROVIDER );
+  QCA::SecureArray wrappedkey( cipher.process( datakey ) );
+  if ( !cipher.ok() )
+  {
+    qDebug( "Data key wrapping failed!" );
+    return QString();
+  }
+
+  QByteArray wrapped( keksalt.toByteArray() );
+  wrapped.append( wrapiv.toByteArray() );
+  wrapped.append( wrappedkey.toByteArray() );
+  return QCA::arrayToHex( wrapped );
+}
+
+bool QgsAuthCrypto::unwrapDataKey( const QString& pass, const QString& wrapped, QCA::SecureArray *datakey )
+{
+  if ( QgsAuthCrypto::isDisabled() )
+    return false;
+
+  QByteArray wrappeddata( QCA::hexToArray( wrapped ) );
+  if ( wrappeddata.size() <= 2 * KEY_GEN_IV_LENGTH )
+    return false;
+
+  QCA::InitializationVector keksalt( wrappeddata.left( KEY_GEN_IV_LENGTH ) );
+  QCA::InitializationVector wrapiv( wrappeddata.mid( KEY_GEN_IV_LENGTH, KEY_GEN_IV_LENGTH ) );
+  QCA::SecureArray wrappedkey( wrappeddata.mid( 2 * KEY_GEN_IV_LENGTH ) );
+
+  QCA::SymmetricKey kek( passwordKey_( pass, keksalt, WRAP_KEY_LENGTH ) );
+  QCA::Cipher cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
+                      QCA::Decode, kek, wrapiv, CIPHER_PROVIDER );
+  QCA::SecureArray key( cipher.process( wrappedkey ) );
+  if ( !cipher.ok() || key.isEmpty() )
+  {
+    qDebug( "Data key unwrapping failed!" );
+    return false;
+  }
+
+  *datakey = key;
+  return true;
 }
 
 void QgsAuthCrypto::passwordKeyHash( const QString& pass, QString *salt, QString *hash, QString *cipheriv )
@@ -109,7 +202,7 @@ bool QgsAuthCrypto::verifyPasswordKeyHash( const QString& pass,
   return hash == derived;
 }
 
-QString QgsAuthCrypto::encryptdecrypt( QString passstr,
+QString QgsAuthCrypto::encryptdecrypt( const QCA::SecureArray& keydata,
                                        QString cipheriv,
                                        QString textstr,
                                        bool encrypt )
@@ -118,43 +211,196 @@ QString QgsAuthCrypto::encryptdecrypt( QString passstr,
   if ( QgsAuthCrypto::isDisabled() )
     return outtxt;
 
-  QCA::InitializationVector iv( QCA::hexToArray( cipheriv ) );
-
-  QCA::SymmetricKey key( QCA::SecureArray( QByteArray( passstr.toUtf8().constData() ) ) );
+  QgsAuthCryptoContext context( keydata, cipheriv );
 
   if ( encrypt )
   {
-    QCA::Cipher cipher = QCA::Cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
-                                      QCA::Encode, key, iv,
-                                      CIPHER_PROVIDER );
-
-    QCA::SecureArray securedata( textstr.toUtf8() );
-    QCA::SecureArray encrypteddata( cipher.process( securedata ) );
-    if ( !cipher.ok() )
-    {
-      qDebug( "Encryption failed!" );
+    QByteArray encrypteddata;
+    if ( !context.encrypt( QCA::SecureArray( textstr.toUtf8() ), &encrypteddata ) )
       return outtxt;
-    }
-    outtxt = QCA::arrayToHex( encrypteddata.toByteArray() );
-    // qDebug( "Encrypted hex: %s", qPrintable( outtxt ) );
+
+    outtxt = QString( encrypteddata.toHex() );
   }
   else
   {
-    QCA::Cipher cipher = QCA::Cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
-                                      QCA::Decode, key, iv,
-                                      CIPHER_PROVIDER );
+    QCA::SecureArray decrypteddata;
+    if ( !context.decrypt( QByteArray::fromHex( textstr.toAscii() ), &decrypteddata ) )
+      return outtxt;
+
+    outtxt = QString::fromUtf8( decrypteddata.constData(), decrypteddata.size() );
+  }
+
+  return outtxt;
+}
+
+//////////////////////////////////////////////////////
+// QgsAuthCryptoContext
+//////////////////////////////////////////////////////
+
+QgsAuthCryptoContext::QgsAuthCryptoContext( const QCA::SecureArray& key, const QString& cipheriv )
+    : mKey( 0 )
+    , mEncoder( 0 )
+    , mDecoder( 0 )
+    , mGcmEncoder( 0 )
+    , mGcmDecoder( 0 )
+{
+  if ( QgsAuthCrypto::isDisabled() || key.isEmpty() )
+    return;
 
-    QCA::SecureArray ciphertext( QCA::hexToArray( textstr ) );
-    QCA::SecureArray decrypteddata( cipher.process( ciphertext ) );
-    if ( !cipher.ok() )
+  mKey = new QCA::SymmetricKey( key );
+  QCA::InitializationVector iv( QCA::hexToArray( cipheriv ) );
+
+  mEncoder = new QCA::Cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
+                              QCA::Encode, *mKey, iv, CIPHER_PROVIDER );
+  mDecoder = new QCA::Cipher( CIPHER_TYPE, CIPHER_MODE, CIPHER_PADDING,
+                              QCA::Decode, *mKey, iv, CIPHER_PROVIDER );
+
+#if QCA_VERSION >= 0x020100
+  if ( QgsAuthCrypto::isAuthenticatedCipherSupported() )
+  {
+    // nonce and tag are set per record, in setup()
+    mGcmEncoder = new QCA::Cipher( CIPHER_TYPE, GCM_MODE, QCA::Cipher::NoPadding,
+                                   QCA::Encode, *mKey, QCA::InitializationVector( GCM_NONCE_LENGTH ),
+                                   QCA::AuthTag( GCM_TAG_LENGTH ), CIPHER_PROVIDER );
+    mGcmDecoder = new QCA::Cipher( CIPHER_TYPE, GCM_MODE, QCA::Cipher::NoPadding,
+                                   QCA::Decode, *mKey, QCA::InitializationVector( GCM_NONCE_LENGTH ),
+                                   QCA::AuthTag( GCM_TAG_LENGTH ), CIPHER_PROVIDER );
+  }
+#endif
+}
+
+QgsAuthCryptoContext::~QgsAuthCryptoContext()
+{
+  delete mGcmEncoder;
+  mGcmEncoder = 0;
+  delete mGcmDecoder;
+  mGcmDecoder = 0;
+  delete mKey;
+  mKey = 0;
+  delete mEncoder;
+  mEncoder = 0;
+  delete mDecoder;
+  mDecoder = 0;
+}
+
+bool QgsAuthCryptoContext::encrypt( const QCA::SecureArray& data, QByteArray *ciphertext )
+{
+  if ( !isValid() )
+    return false;
+
+  QMutexLocker locker( &mMutex );
+
+  if ( mGcmEncoder )
+    return encryptGcm( data, ciphertext );
+
+  // reset to the state right after setup, reusing the key schedule
+  mEncoder->clear();
+  QCA::SecureArray encrypteddata( mEncoder->process( data ) );
+  if ( !mEncoder->ok() )
+  {
+    qDebug( "Encryption failed!" );
+    return false;
+  }
+  *ciphertext = encrypteddata.toByteArray();
+  return true;
+}
+
+bool QgsAuthCryptoContext::decrypt( const QByteArray& ciphertext, QCA::SecureArray *data, bool *legacy )
+{
+  if ( !isValid() )
+    return false;
+
+  QMutexLocker locker( &mMutex );
+
+  // anything carrying the envelope header is authenticated: it must verify, never fall back to CBC
+  if ( ciphertext.startsWith( ENVELOPE_MAGIC ) )
+  {
+    if ( legacy )
+      *legacy = false;
+
+    if ( ciphertext.size() < ENVELOPE_HEADER_LENGTH + GCM_NONCE_LENGTH + GCM_TAG_LENGTH
+         || ( quint8 )ciphertext.at( ENVELOPE_MAGIC_LENGTH ) != AesGcmV1 )
     {
-      qDebug( "Decryption failed!" );
-      return outtxt;
+      qDebug( "Decryption failed: unknown or truncated envelope" );
+      return false;
+    }
+    if ( !mGcmDecoder )
+    {
+      qDebug( "Decryption failed: authenticated cipher (AES-GCM) NOT supported" );
+      return false;
     }
+    if ( !decryptGcm( ciphertext, data ) )
+    {
+      qDebug( "Decryption failed: envelope authentication failed" );
+      return false;
+    }
+    return true;
+  }
 
-    outtxt = QString( decrypteddata.toByteArray() );
-    // qDebug( "Decrypted text %s", qPrintable( outtxt ) ); // DO NOT LEAVE THIS LINE UNCOMMENTED
+  if ( legacy )
+    *legacy = true;
+
+  mDecoder->clear();
+  QCA::SecureArray decrypteddata( mDecoder->process( QCA::SecureArray( ciphertext ) ) );
+  if ( !mDecoder->ok() )
+  {
+    qDebug( "Decryption failed!" );
+    return false;
   }
+  *data = decrypteddata;
+  return true;
+}
 
-  return outtxt;
+bool QgsAuthCryptoContext::encryptGcm( const QCA::SecureArray& data, QByteArray *envelope )
+{
+#if QCA_VERSION >= 0x020100
+  QCA::InitializationVector nonce( GCM_NONCE_LENGTH );
+  mGcmEncoder->setup( QCA::Encode, *mKey, nonce, QCA::AuthTag( GCM_TAG_LENGTH ) );
+
+  QCA::SecureArray encrypteddata( mGcmEncoder->update( data ) );
+  encrypteddata += mGcmEncoder->final();
+  QCA::AuthTag tag( mGcmEncoder->tag() );
+  if ( !mGcmEncoder->ok() || tag.size() != GCM_TAG_LENGTH )
+  {
+    qDebug( "Encryption failed!" );
+    return false;
+  }
+
+  QByteArray out;
+  out.reserve( ENVELOPE_HEADER_LENGTH + GCM_NONCE_LENGTH + GCM_TAG_LENGTH + encrypteddata.size() );
+  out.append( ENVELOPE_MAGIC );
+  out.append( ( char )AesGcmV1 );
+  out.append( nonce.toByteArray() );
+  out.append( tag.toByteArray() );
+  out.append( encrypteddata.toByteArray() );
+  *envelope = out;
+  return true;
+#else
+  Q_UNUSED( data );
+  Q_UNUSED( envelope );
+  return false;
+#endif
+}
+
+bool QgsAuthCryptoContext::decryptGcm( const QByteArray& envelope, QCA::SecureArray *data )
+{
+#if QCA_VERSION >= 0x020100
+  QCA::InitializationVector nonce( envelope.mid( ENVELOPE_HEADER_LENGTH, GCM_NONCE_LENGTH ) );
+  QCA::AuthTag tag( envelope.mid( ENVELOPE_HEADER_LENGTH + GCM_NONCE_LENGTH, GCM_TAG_LENGTH ) );
+  QCA::SecureArray encrypteddata( envelope.mid( ENVELOPE_HEADER_LENGTH + GCM_NONCE_LENGTH + GCM_TAG_LENGTH ) );
+
+  mGcmDecoder->setup( QCA::Decode, *mKey, nonce, tag );
+  QCA::SecureArray decrypteddata( mGcmDecoder->update( encrypteddata ) );
+  decrypteddata += mGcmDecoder->final();
+  // final() fails on tag mismatch, i.e. wrong key or tampered record
+  if ( !mGcmDecoder->ok() )
+    return false;
+
+  *data = decrypteddata;
+  return true;
+#else
+  Q_UNUSED( envelope );
+  Q_UNUSED( data );
+  return false;
+#endif
 }
@@ -17,8 +17,17 @@
 #ifndef QGSAUTHENTICATIONCRYPTO_H
 #define QGSAUTHENTICATIONCRYPTO_H
 
+#include <QByteArray>
+#include <QMutex>
 #include <QString>
 
+namespace QCA
+{
+  class Cipher;
+  class SecureArray;
+  class SymmetricKey;
+}
+
 /** \ingroup core
  * Funtions for hashing/checking master password and encrypt/decrypting data with password
  * \since 2.8
@@ -30,12 +39,26 @@ class CORE_EXPORT QgsAuthCrypto
     /** Whether QCA has the qca-ossl plugin, which a base run-time requirement */
     static bool isDisabled();
 
+    /** Whether authenticated encryption (AES-GCM) is available through qca-ossl */
+    static bool isAuthenticatedCipherSupported();
+
     /** Encrypt data using master password */
     static const QString encrypt( QString pass, QString cipheriv, QString text );
 
     /** Decrypt data using master password */
     static const QString decrypt( QString pass, QString cipheriv, QString text );
 
+    /** Generate a random data encryption key */
+    static void generateDataKey( QCA::SecureArray *datakey );
+
+    /** Wrap a data encryption key with a key derived from master password
+     * @return Hex of key-derivation salt, wrapping IV and wrapped key, or empty string on failure
+     */
+    static const QString wrapDataKey( const QString& pass, const QCA::SecureArray& datakey );
+
+    /** Unwrap a data encryption key previously wrapped with master password */
+    static bool unwrapDataKey( const QString& pass, const QString& wrapped, QCA::SecureArray *datakey );
+
     /** Generate SHA256 hash for master password, with iterations and salt */
     static void passwordKeyHash( const QString &pass,
                                  QString *salt,
@@ -49,10 +72,71 @@ class CORE_EXPORT QgsAuthCrypto
                                        QString *hashderived = 0 );
 
   private:
-    static QString encryptdecrypt( QString passstr,
+    static QString encryptdecrypt( const QCA::SecureArray& keydata,
                                    QString cipheriv,
                                    QString textstr,
                                    bool encrypt );
+
+    static bool smCipherSupported;
+    static int smAuthCipherSupport;
+};
+
+/** \ingroup core
+ * Reusable cipher context holding the key schedule for a session's data encryption key,
+ * so ciphers are not looked up and set up again for every encrypt/decrypt
+ *
+ * When AES-GCM is available, records are written as a versioned envelope:
+ * 'QGAE' magic, format version byte, per-record nonce, authentication tag, then ciphertext.
+ * Legacy records, which are bare AES-CBC ciphertext using the shared civ, remain readable.
+ * Records with the envelope header must authenticate; they are never decrypted as legacy.
+ * \note Calls are serialized internally, since QCA ciphers are stateful
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthCryptoContext
+{
+  public:
+    /**
+     * Construct context for a key and hex-encoded initialization vector
+     * @param key Data encryption key
+     * @param cipheriv Hex-encoded cipher initialization vector
+     */
+    QgsAuthCryptoContext( const QCA::SecureArray& key, const QString& cipheriv );
+
+    ~QgsAuthCryptoContext();
+
+    /** Whether ciphers were set up for the key */
+    bool isValid() const { return mEncoder && mDecoder; }
+
+    /** Encrypt data to raw ciphertext */
+    bool encrypt( const QCA::SecureArray& data, QByteArray *ciphertext );
+
+    /**
+     * Decrypt raw ciphertext to data
+     * @param ciphertext Envelope or legacy ciphertext
+     * @param data Decrypted data
+     * @param legacy Set to whether ciphertext was a legacy (unauthenticated) record
+     */
+    bool decrypt( const QByteArray& ciphertext, QCA::SecureArray *data, bool *legacy = 0 );
+
+    /** Format version byte following the envelope magic (legacy CBC records have no header) */
+    enum EnvelopeVersion
+    {
+      AesGcmV1 = 0x01
+    };
+
+  private:
+    Q_DISABLE_COPY( QgsAuthCryptoContext )
+
+    bool encryptGcm( const QCA::SecureArray& data, QByteArray *envelope );
+
+    bool decryptGcm( const QByteArray& envelope, QCA::SecureArray *data );
+
+    QCA::SymmetricKey *mKey;
+    QCA::Cipher *mEncoder;
+    QCA::Cipher *mDecoder;
+    QCA::Cipher *mGcmEncoder;
+    QCA::Cipher *mGcmDecoder;
+    QMutex mMutex;
 };
 
 #endif  // QGSAUTHENTICATIONCRYPTO_H
@@ -0,0 +1,78 @@
+/***************************************************************************
+    qgsauthenticationdb.cpp
+    ---------------------
+    begin                : October 17, 2026
+    copyright            : (C) 2026 by QGIS Development Team
+    author               : QGIS Development Team
+    email                : qgis-developer at lists dot osgeo dot org
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "qgsauthenticationdb.h"
+
+#include <QSqlError>
+
+#include "qgslogger.h"
+
+
+QgsAuthDb::QgsAuthDb( const QString& connectionName, const QString& dbPath, const QString& connectOptions )
+{
+  if ( QSqlDatabase::contains( connectionName ) )
+  {
+    mDb = QSqlDatabase::database( connectionName, false );
+  }
+  else
+  {
+    mDb = QSqlDatabase::addDatabase( "QSQLITE", connectionName );
+    mDb.setDatabaseName( dbPath );
+    mDb.setConnectOptions( connectOptions );
+  }
+  QgsDebugMsg( QString( "Auth db connection added: %1" ).arg( connectionName ) );
+}
+
+QgsAuthDb::~QgsAuthDb()
+{
+  clearStatements();
+
+  QString connectionname( mDb.connectionName() );
+  mDb.close();
+  mDb = QSqlDatabase(); // release handle, so the connection can be removed
+  QSqlDatabase::removeDatabase( connectionname );
+  QgsDebugMsg( QString( "Auth db connection removed: %1" ).arg( connectionname ) );
+}
+
+QSqlQuery *QgsAuthDb::statement( const QString& sql )
+{
+  QHash<QString, QSqlQuery*>::const_iterator it = mStatements.constFind( sql );
+  if ( it != mStatements.constEnd() )
+    return it.value();
+
+  if ( !mDb.isOpen() )
+    return 0;
+
+  QSqlQuery *query = new QSqlQuery( mDb );
+  // must be set before prepare
+  query->setForwardOnly( true );
+  if ( !query->prepare( sql ) )
+  {
+    QgsDebugMsg( QString( "Auth db statement prepare FAILED: %1\nError: %2" )
+                 .arg( sql ).arg( query->lastError().text() ) );
+    delete query;
+    return 0;
+  }
+
+  mStatements.insert( sql, query );
+  return query;
+}
+
+void QgsAuthDb::clearStatements()
+{
+  qDeleteAll( mStatements );
+  mStatements.clear();
+}
@@ -0,0 +1,93 @@
+/***************************************************************************
+    qgsauthenticationdb.h
+    ---------------------
+    begin                : October 17, 2026
+    copyright            : (C) 2026 by QGIS Development Team
+    author               : QGIS Development Team
+    email                : qgis-developer at lists dot osgeo dot org
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef QGSAUTHENTICATIONDB_H
+#define QGSAUTHENTICATIONDB_H
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+
+/** \ingroup core
+ * Data access for the authentication database: owns a named connection
+ * and long-lived prepared statements, so hot lookups only rebind values and re-execute
+ * \note QtSql connections and their statements may only be used from the thread that
+ * created them, so there is one instance per thread (see QgsAuthManager::authDbConnection)
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthDb
+{
+  public:
+    /**
+     * Construct data access, adding a connection (not yet opened)
+     * @param connectionName Unique connection name, e.g. per thread
+     * @param dbPath Path to SQLite database
+     * @param connectOptions QSQLITE driver connect options
+     */
+    QgsAuthDb( const QString& connectionName, const QString& dbPath, const QString& connectOptions = QString() );
+
+    /** Drops statements, then closes and removes the connection */
+    ~QgsAuthDb();
+
+    /** The owned connection, without lookup by connection name */
+    QSqlDatabase database() const { return mDb; }
+
+    /**
+     * Get a prepared statement for SQL, preparing it on first use
+     * @note Finish it (see QgsAuthDbStatement) once results are read, to release its read lock
+     * @return 0 if statement could not be prepared
+     */
+    QSqlQuery *statement( const QString& sql );
+
+    /** Drop all prepared statements, e.g. before closing connection */
+    void clearStatements();
+
+    /** Number of prepared statements held */
+    int statementCount() const { return mStatements.size(); }
+
+  private:
+    Q_DISABLE_COPY( QgsAuthDb )
+
+    QSqlDatabase mDb;
+    QHash<QString, QSqlQuery*> mStatements;
+};
+
+/** \ingroup core
+ * Scoped use of a prepared statement from QgsAuthDb, which is finished when going out of scope
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthDbStatement
+{
+  public:
+    explicit QgsAuthDbStatement( QSqlQuery *query ) : mQuery( query ) {}
+
+    ~QgsAuthDbStatement() { if ( mQuery ) mQuery->finish(); }
+
+    /** Whether the statement was prepared */
+    bool isValid() const { return mQuery != 0; }
+
+    QSqlQuery *query() const { return mQuery; }
+
+    QSqlQuery *operator->() const { return mQuery; }
+
+  private:
+    Q_DISABLE_COPY( QgsAuthDbStatement )
+
+    QSqlQuery *mQuery;
+};
+
+#endif // QGSAUTHENTICATIONDB_H
@@ -16,14 +16,21 @@
 
 #include "qgsauthenticationmanager.h"
 
+#include <QDateTime>
+#include <QCoreApplication>
 #include <QDir>
 #include <QEventLoop>
 #include <QFileInfo>
+#include <QFileSystemWatcher>
 #include <QObject>
+#include <QRegExp>
+#include <QRunnable>
+#include <QSettings>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QTextStream>
+#include <QThread>
 #include <QTime>
 #include <QTimer>
 #include <QVariant>
@@ -35,12 +42,59 @@
 #endif
 
 #include "qgsapplication.h"
+#include "qgsauthenticationcertregistry.h"
 #include "qgsauthenticationcertutils.h"
 #include "qgsauthenticationcrypto.h"
+#include "qgsauthenticationdb.h"
 #include "qgsauthenticationprovider.h"
 #include "qgscredentials.h"
 #include "qgslogger.h"
 
+// QThread::msleep is protected in Qt4
+class QgsAuthSleeper : public QThread
+{
+  public:
+    static void msleep( unsigned long msecs ) { QThread::msleep( msecs ); }
+};
+
+// builds a provider's cached config off the manager's thread, optionally reporting back for prewarm
+class QgsAuthWarmTask : public QRunnable
+{
+  public:
+    QgsAuthWarmTask( QgsAuthProvider *provider, const QString& authcfg, QgsAuthManager *reportto = 0 )
+        : mProvider( provider ), mAuthCfg( authcfg ), mReportTo( reportto ) {}
+
+    void run()
+    {
+      QTime t;
+      t.start();
+      bool ok = mProvider->warmCachedConfig( mAuthCfg );
+      int elapsed = t.elapsed();
+      QgsDebugMsg( QString( "Warm cache for config %1: %2 in %3 ms" )
+                   .arg( mAuthCfg ).arg( ok ? "SUCCEEDED" : "FAILED" ).arg( elapsed ) );
+
+      if ( mReportTo )
+      {
+        QMetaObject::invokeMethod( mReportTo, "prewarmConfigDone", Qt::QueuedConnection,
+                                   Q_ARG( QString, mAuthCfg ), Q_ARG( bool, ok ), Q_ARG( int, elapsed ) );
+      }
+    }
+
+  private:
+    QgsAuthProvider *mProvider;
+    QString mAuthCfg;
+    QgsAuthManager *mReportTo;
+};
+
+// existence, size and modification time, to tell whether a watched file really changed
+static QString fileState_( const QString& path )
+{
+  QFileInfo fi( path );
+  if ( !fi.exists() )
+    return QString();
+  return QString( "%1:%2" ).arg( fi.size() ).arg( fi.lastModified().toMSecsSinceEpoch() );
+}
+
 
 const QString QgsAuthManager::smAuthConfigTable = "auth_configs";
 const QString QgsAuthManager::smAuthPassTable = "auth_pass";
@@ -49,7 +103,11 @@ const QString QgsAuthManager::smAuthIdentitiesTable = "auth_identities";
 const QString QgsAuthManager::smAuthServersTable = "auth_servers";
 const QString QgsAuthManager::smAuthAuthoritiesTable = "auth_authorities";
 const QString QgsAuthManager::smAuthTrustTable = "auth_trust";
+const QString QgsAuthManager::smAuthCaFileCacheTable = "auth_cafile_cache";
 const QString QgsAuthManager::smAuthManTag = QObject::tr( "Authentication Manager" );
+// 1: ciphertext and certificates stored as raw BLOBs, instead of hex/PEM text
+// 2: cache of filtered extra CA file certs
+const int QgsAuthManager::smAuthDbSchemaVersion = 2;
 
 QSqlDatabase QgsAuthManager::authDbConnection() const
 {
@@ -57,22 +115,77 @@ QSqlDatabase QgsAuthManager::authDbConnection() const
   if ( isDisabled() )
     return authdb;
 
-  QString connectionname = "authentication.configs";
-  if ( !QSqlDatabase::contains( connectionname ) )
-  {
-    authdb = QSqlDatabase::addDatabase( "QSQLITE", connectionname );
-    authdb.setDatabaseName( authenticationDbPath() );
-  }
-  else
+  // QtSql connections are bound to the thread that created them, so each thread gets its own,
+  // created lazily here and removed when the thread exits (QThreadStorage deletes it)
+  if ( !mAuthDbs.hasLocalData() )
   {
-    authdb = QSqlDatabase::database( connectionname );
+    QString connectionname = "authentication.configs";
+    QThread *thread = QThread::currentThread();
+    if ( QCoreApplication::instance() && thread != QCoreApplication::instance()->thread() )
+    {
+      connectionname += QString( ":0x%1" ).arg(( quintptr )thread, 0, 16 );
+    }
+    // driver-level busy handler, so waits on another process's lock happen inside SQLite
+    QSettings settings;
+    QString options( QString( "QSQLITE_BUSY_TIMEOUT=%1" )
+                     .arg( settings.value( "/qgis/auth/db/busy_timeout", 5000 ).toInt() ) );
+    mAuthDbs.setLocalData( new QgsAuthDb( connectionname, authenticationDbPath(), options ) );
   }
-  if ( !authdb.isOpen() )
-    authdb.open();
+
+  authdb = mAuthDbs.localData()->database();
+  if ( !authdb.isOpen() && authdb.open() )
+    authDbSetPragmas( authdb );
 
   return authdb;
 }
 
+QSqlQuery *QgsAuthManager::authDbStatement( const QString& sql ) const
+{
+  if ( isDisabled() )
+    return 0;
+
+  authDbConnection(); // ensure created and opened for this thread
+  QSqlQuery *query = mAuthDbs.localData()->statement( sql );
+  if ( !query )
+    emit messageOut( tr( "Auth db query FAILED to prepare" ), authManTag(), WARNING );
+  return query;
+}
+
+void QgsAuthManager::authDbSetPragmas( QSqlDatabase &authdb ) const
+{
+  // NOTE: WAL (opt-in) needs shared memory, which breaks on network file systems where home dirs
+  //       may live, so default to a rollback journal; journal mode persists in the db file,
+  //       the rest is per connection
+  QSettings settings;
+  QString journalmode( settings.value( "/qgis/auth/db/journal_mode", "DELETE" ).toString().toUpper() );
+  QString synchronous( settings.value( "/qgis/auth/db/synchronous", "NORMAL" ).toString().toUpper() );
+  QString tempstore( settings.value( "/qgis/auth/db/temp_store", "MEMORY" ).toString().toUpper() );
+  int cachesize = settings.value( "/qgis/auth/db/cache_size", -2000 ).toInt(); // negative: KiB
+  qint64 mmapsize = settings.value( "/qgis/auth/db/mmap_size", 0 ).toLongLong();
+
+  // PRAGMA does not accept bound values, so only pass known keywords
+  QStringList pragmas;
+  if ( QString( "DELETE,TRUNCATE,PERSIST,MEMORY,WAL,OFF" ).split( "," ).contains( journalmode ) )
+    pragmas << QString( "PRAGMA journal_mode = %1" ).arg( journalmode );
+  if ( QString( "OFF,NORMAL,FULL,EXTRA" ).split( "," ).contains( synchronous ) )
+    pragmas << QString( "PRAGMA synchronous = %1" ).arg( synchronous );
+  if ( QString( "DEFAULT,FILE,MEMORY" ).split( "," ).contains( tempstore ) )
+    pragmas << QString( "PRAGMA temp_store = %1" ).arg( tempstore );
+  pragmas << QString( "PRAGMA cache_size = %1" ).arg( cachesize );
+  pragmas << QString( "PRAGMA mmap_size = %1" ).arg( mmapsize );
+
+  Q_FOREACH( const QString& pragma, pragmas )
+  {
+    QSqlQuery query( authdb );
+    if ( !query.exec( pragma ) )
+    {
+      // not fatal: db stays usable with SQLite defaults
+      QgsDebugMsg( QString( "Auth db pragma FAILED: %1\nError: %2" ).arg( pragma ).arg( query.lastError().text() ) );
+    }
+  }
+  QgsDebugMsg( QString( "Auth db pragmas set: %1" ).arg( pragmas.join( "; " ) ) );
+}
+
 bool QgsAuthManager::init()
 {
   QgsDebugMsg( "Initializing QCA..." );
@@ -144,7 +257,7 @@ bool QgsAuthManager::init()
     {
       QgsDebugMsg( "Auth db exists and has data" );
 
-      if ( !createCertTables() )
+      if ( !updateAuthDbSchema() )
         return false;
 
       updateConfigProviderTypes();
@@ -167,6 +280,9 @@ bool QgsAuthManager::init()
 
     if ( !createCertTables() )
       return false;
+
+    if ( !setAuthDbSchemaVersion( smAuthDbSchemaVersion ) )
+      return false;
   }
 
 #ifndef QT_NO_OPENSSL
@@ -197,7 +313,8 @@ bool QgsAuthManager::createConfigTables()
   qstr = QString( "CREATE TABLE %1 (\n"
                   "    'salt' TEXT NOT NULL,\n"
                   "    'civ' TEXT NOT NULL\n"
-                  ", 'hash' TEXT  NOT NULL);" ).arg( authDbPassTable() );
+                  ", 'hash' TEXT  NOT NULL\n"
+                  ", 'dek' TEXT);" ).arg( authDbPassTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
     return false;
@@ -209,7 +326,7 @@ bool QgsAuthManager::createConfigTables()
                   "    'uri' TEXT,\n"
                   "    'type' TEXT NOT NULL,\n"
                   "    'version' INTEGER NOT NULL\n"
-                  ", 'config' TEXT  NOT NULL);" ).arg( authDbConfigTable() );
+                  ", 'config' BLOB  NOT NULL);" ).arg( authDbConfigTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
     return false;
@@ -232,7 +349,7 @@ bool QgsAuthManager::createConfigTables()
 
 bool QgsAuthManager::createCertTables()
 {
-  // NOTE: these tables were added later, so IF NOT EXISTS is used
+  // NOTE: these tables were added later, so IF NOT EXISTS is used (for schema migration)
   QgsDebugMsg( "Creating cert tables in auth db" );
 
   QSqlQuery query( authDbConnection() );
@@ -240,9 +357,11 @@ bool QgsAuthManager::createCertTables()
   // create the tables
   QString qstr;
 
+  // encrypted: whether value is hex ciphertext, stored with encrypt = true
   qstr = QString( "CREATE TABLE IF NOT EXISTS %1 (\n"
-                  "    'setting' TEXT NOT NULL\n"
-                  ", 'value' TEXT);" ).arg( authDbSettingsTable() );
+                  "    'setting' TEXT NOT NULL,\n"
+                  "    'value' TEXT\n"
+                  ", 'encrypted' INTEGER NOT NULL DEFAULT 0);" ).arg( authDbSettingsTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
     return false;
@@ -251,8 +370,8 @@ bool QgsAuthManager::createCertTables()
 
   qstr = QString( "CREATE TABLE IF NOT EXISTS %1 (\n"
                   "    'id' TEXT NOT NULL,\n"
-                  "    'key' TEXT NOT NULL\n"
-                  ", 'cert' TEXT  NOT NULL);" ).arg( authDbIdentitiesTable() );
+                  "    'key' BLOB NOT NULL\n"
+                  ", 'cert' BLOB  NOT NULL);" ).arg( authDbIdentitiesTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
     return false;
@@ -268,7 +387,7 @@ bool QgsAuthManager::createCertTables()
   qstr = QString( "CREATE TABLE IF NOT EXISTS %1 (\n"
                   "    'id' TEXT NOT NULL,\n"
                   "    'host' TEXT NOT NULL,\n"
-                  "    'cert' TEXT\n"
+                  "    'cert' BLOB\n"
                   ", 'config' TEXT  NOT NULL);" ).arg( authDbServersTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
@@ -284,7 +403,7 @@ bool QgsAuthManager::createCertTables()
 
   qstr = QString( "CREATE TABLE IF NOT EXISTS %1 (\n"
                   "    'id' TEXT NOT NULL\n"
-                  ", 'cert' TEXT  NOT NULL);" ).arg( authDbAuthoritiesTable() );
+                  ", 'cert' BLOB  NOT NULL);" ).arg( authDbAuthoritiesTable() );
   query.prepare( qstr );
   if ( !authDbQuery( &query ) )
     return false;
@@ -310,6 +429,237 @@ bool QgsAuthManager::createCertTables()
     return false;
   query.clear();
 
+  // single row: file state key and DER certs of extra CA file, after filtering
+  qstr = QString( "CREATE TABLE IF NOT EXISTS %1 (\n"
+                  "    'id' TEXT NOT NULL\n"
+                  ", 'certs' BLOB  NOT NULL);" ).arg( authDbCaFileCacheTable() );
+  query.prepare( qstr );
+  if ( !authDbQuery( &query ) )
+    return false;
+  query.clear();
+
+  return true;
+}
+
+bool QgsAuthManager::updatePassTable()
+{
+  // NOTE: wrapped data key column was added later, for envelope encryption
+  QSqlQuery query( authDbConnection() );
+  query.prepare( QString( "PRAGMA table_info(%1)" ).arg( authDbPassTable() ) );
+  if ( !authDbQuery( &query ) )
+    return false;
+
+  while ( query.next() )
+  {
+    if ( query.value( 1 ).toString() == QString( "dek" ) )
+      return true;
+  }
+  query.clear();
+
+  QgsDebugMsg( "Adding data key column to password table in auth db" );
+  query.prepare( QString( "ALTER TABLE %1 ADD COLUMN 'dek' TEXT" ).arg( authDbPassTable() ) );
+  return authDbQuery( &query );
+}
+
+bool QgsAuthManager::updateSettingsTable()
+{
+  // NOTE: encrypted flag column was added later, so re-encryption need not guess which values are ciphertext
+  QSqlQuery query( authDbConnection() );
+  query.prepare( QString( "PRAGMA table_info(%1)" ).arg( authDbSettingsTable() ) );
+  if ( !authDbQuery( &query ) )
+    return false;
+
+  while ( query.next() )
+  {
+    if ( query.value( 1 ).toString() == QString( "encrypted" ) )
+      return true;
+  }
+  query.clear();
+
+  // existing values are taken as plain text: nothing here stores settings with encrypt = true
+  QgsDebugMsg( "Adding encrypted flag column to settings table in auth db" );
+  query.prepare( QString( "ALTER TABLE %1 ADD COLUMN 'encrypted' INTEGER NOT NULL DEFAULT 0" ).arg( authDbSettingsTable() ) );
+  return authDbQuery( &query );
+}
+
+int QgsAuthManager::authDbSchemaVersion() const
+{
+  QSqlQuery query( authDbConnection() );
+  query.prepare( "PRAGMA user_version" );
+  if ( !authDbQuery( &query ) || !query.next() )
+    return -1;
+
+  return query.value( 0 ).toInt();
+}
+
+bool QgsAuthManager::setAuthDbSchemaVersion( int version )
+{
+  // PRAGMA does not accept bound values
+  QSqlQuery query( authDbConnection() );
+  query.prepare( QString( "PRAGMA user_version = %1" ).arg( version ) );
+  return authDbQuery( &query );
+}
+
+bool QgsAuthManager::updateAuthDbSchema()
+{
+  int version = authDbSchemaVersion();
+  if ( version < 0 )
+    return false;
+
+  if ( version == smAuthDbSchemaVersion )
+  {
+    QgsDebugMsg( QString( "Auth db schema is current (version %1)" ).arg( version ) );
+    return true;
+  }
+
+  if ( version > smAuthDbSchemaVersion )
+  {
+    // created by a newer version; leave it untouched
+    QgsDebugMsg( QString( "Auth db schema version %1 is newer than supported version %2" )
+                 .arg( version ).arg( smAuthDbSchemaVersion ) );
+    emit messageOut( tr( "Authentication database was created by a newer version" ), authManTag(), WARNING );
+    return true;
+  }
+
+  // migration steps rewrite stored data, so keep a copy of the db as it was
+  QString dbbackup;
+  if ( !authDbBackup( QString( "v%1" ).arg( version ), &dbbackup ) )
+  {
+    const char* err = QT_TR_NOOP( "Auth db schema update FAILED: could not backup current database" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), CRITICAL );
+    return false;
+  }
+  QgsDebugMsg( QString( "Auth db schema update: backed up previous db at %1" ).arg( dbbackup ) );
+
+  // each step runs in its own transaction and bumps the version on success,
+  // so an interrupted update resumes at the failed step
+  for ( int step = version + 1; step <= smAuthDbSchemaVersion; ++step )
+  {
+    QgsDebugMsg( QString( "Migrating auth db schema to version %1" ).arg( step ) );
+
+    if ( !authDbStartTransaction() )
+      return false;
+
+    bool ok = false;
+    switch ( step )
+    {
+      case 1:
+        ok = migrateSchemaToV1();
+        break;
+      case 2:
+        // CA file cache table
+        ok = createCertTables();
+        break;
+      default:
+        break;
+    }
+
+    if ( !ok || !setAuthDbSchemaVersion( step ) )
+    {
+      authDbConnection().rollback();
+      const char* err = QT_TR_NOOP( "Auth db schema update FAILED, changes rolled back" );
+      QgsDebugMsg( QString( "%1 (version %2)" ).arg( err ).arg( step ) );
+      emit messageOut( tr( err ), authManTag(), CRITICAL );
+      return false;
+    }
+
+    if ( !authDbCommit() )
+      return false;
+  }
+
+  masterPasswordInvalidateRow();
+
+  // reclaim the space of rewritten data; can not be run inside a transaction
+  QSqlQuery vacuum( authDbConnection() );
+  vacuum.prepare( "VACUUM" );
+  authDbQuery( &vacuum );
+
+  QgsDebugMsg( QString( "Auth db schema updated to version %1" ).arg( smAuthDbSchemaVersion ) );
+  return true;
+}
+
+bool QgsAuthManager::migrateSchemaToV1()
+{
+  // pre-versioned dbs: may lack cert tables and the wrapped data key column
+  if ( !createCertTables() )
+    return false;
+
+  if ( !updatePassTable() )
+    return false;
+
+  if ( !updateSettingsTable() )
+    return false;
+
+  // ciphertext and certificates to BLOB storage
+  // NOTE: columns keep their declared TEXT type in older dbs; SQLite stores BLOB values as-is
+
+  // table, key column, value column, whether value is hex ciphertext (else PEM certificate)
+  struct BlobColumn
+  {
+    QString table;
+    const char *column;
+    bool ciphertext;
+  };
+  const BlobColumn columns[] =
+  {
+    { authDbConfigTable(), "config", true },
+    { authDbIdentitiesTable(), "key", true },
+    { authDbIdentitiesTable(), "cert", false },
+    { authDbServersTable(), "cert", false },
+    { authDbAuthoritiesTable(), "cert", false }
+  };
+
+  for ( unsigned int i = 0; i < sizeof( columns ) / sizeof( columns[0] ); ++i )
+  {
+    const BlobColumn &col = columns[i];
+
+    // gather first, so rows are not updated under an active select
+    QList< QPair<QString, QByteArray> > rows;
+    QSqlQuery query( authDbConnection() );
+    query.prepare( QString( "SELECT id, %1 FROM %2" ).arg( col.column ).arg( col.table ) );
+    if ( !authDbQuery( &query ) )
+      return false;
+    while ( query.next() )
+    {
+      if ( query.value( 1 ).type() != QVariant::String )
+        continue; // already binary, or NULL
+
+      QByteArray text( query.value( 1 ).toString().toAscii() );
+      QByteArray blob;
+      if ( col.ciphertext )
+      {
+        blob = QByteArray::fromHex( text );
+      }
+#ifndef QT_NO_OPENSSL
+      else
+      {
+        QSslCertificate cert( text, QSsl::Pem );
+        if ( cert.isNull() )
+        {
+          QgsDebugMsg( QString( "Skipping migration of unparsable certificate in %1 for id: %2" )
+                       .arg( col.table ).arg( query.value( 0 ).toString() ) );
+          continue;
+        }
+        blob = cert.toDer();
+      }
+#endif
+      if ( !blob.isEmpty() )
+        rows << qMakePair( query.value( 0 ).toString(), blob );
+    }
+    query.clear();
+
+    query.prepare( QString( "UPDATE %1 SET %2 = :value WHERE id = :id" ).arg( col.table ).arg( col.column ) );
+    for ( int j = 0; j < rows.size(); ++j )
+    {
+      query.bindValue( ":value", rows.at( j ).second );
+      query.bindValue( ":id", rows.at( j ).first );
+      if ( !authDbQuery( &query ) )
+        return false;
+    }
+    QgsDebugMsg( QString( "Migrated %1 %2 values to BLOB in %3" ).arg( rows.size() ).arg( col.column ).arg( col.table ) );
+  }
+
   return true;
 }
 
@@ -333,7 +683,12 @@ bool QgsAuthManager::setMasterPassword( bool verify )
   if ( isDisabled() )
     return false;
 
-  if ( mMasterPass.isEmpty() )
+  if ( masterPasswordIsSet() && ( !verify || masterPasswordSessionVerified() ) )
+    return true;
+
+  // concurrent callers wait here for a single input prompt, without blocking mMutex users
+  QMutexLocker passlocker( &mMasterPassMutex );
+  if ( !masterPasswordIsSet() )
   {
     QgsDebugMsg( "Master password is not yet set by user" );
     if ( !masterPasswordInput() )
@@ -361,12 +716,20 @@ bool QgsAuthManager::setMasterPassword( const QString& pass, bool verify )
   if ( isDisabled() )
     return false;
 
+  QMutexLocker passlocker( &mMasterPassMutex );
+  QMutexLocker locker( &mMutex );
   // since this is generally for automation, we don't care if passed-in is same as existing
   QString prevpass = QString( mMasterPass );
+  if ( pass != mMasterPass )
+    masterPasswordSessionReset();
   mMasterPass = pass;
+  locker.unlock();
+
   if ( verify && !verifyMasterPassword() )
   {
+    locker.relock();
     mMasterPass = prevpass;
+    locker.unlock();
     const char* err = QT_TR_NOOP( "Master password set: FAILED to verify, reset to previous" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
@@ -382,6 +745,16 @@ bool QgsAuthManager::verifyMasterPassword()
   if ( isDisabled() )
     return false;
 
+  // key derivation and db access happen with only the password guard held
+  QMutexLocker passlocker( &mMasterPassMutex );
+
+  // skip re-deriving the key hash if this password was already verified against current auth_pass row
+  if ( masterPasswordSessionVerified() )
+  {
+    QgsDebugMsg( "Master password: already verified for session" );
+    return true;
+  }
+
   int rows = 0;
   if ( !masterPasswordRowsInDb( &rows ) )
   {
@@ -395,6 +768,8 @@ bool QgsAuthManager::verifyMasterPassword()
 
   QgsDebugMsg( QString( "Master password: %1 rows in database" ).arg( rows ) );
 
+  QString keyhash;
+
   if ( rows > 1 )
   {
     const char* err = QT_TR_NOOP( "Master password: FAILED to find just one master password record in database" );
@@ -406,7 +781,7 @@ bool QgsAuthManager::verifyMasterPassword()
   }
   else if ( rows == 1 )
   {
-    if ( !masterPasswordCheckAgainstDb() )
+    if ( !masterPasswordCheckAgainstDb( &keyhash ) )
     {
       const char* err = QT_TR_NOOP( "Master password: FAILED to verify against hash in database" );
       QgsDebugMsg( err );
@@ -419,7 +794,6 @@ bool QgsAuthManager::verifyMasterPassword()
     else
     {
       QgsDebugMsg( "Master password: verified against hash in database" );
-      emit masterPasswordVerified( true );
     }
   }
   else
@@ -438,7 +812,7 @@ bool QgsAuthManager::verifyMasterPassword()
       QgsDebugMsg( "Master password: hash stored in database" );
     }
     // double-check storing
-    if ( !masterPasswordCheckAgainstDb() )
+    if ( !masterPasswordCheckAgainstDb( &keyhash ) )
     {
       const char* err = QT_TR_NOOP( "Master password: FAILED to verify against hash in database" );
       QgsDebugMsg( err );
@@ -451,20 +825,58 @@ bool QgsAuthManager::verifyMasterPassword()
     else
     {
       QgsDebugMsg( "Master password: verified against hash in database" );
-      emit masterPasswordVerified( true );
     }
   }
 
+  if ( !masterPasswordLoadDataKey() )
+  {
+    const char* err = QT_TR_NOOP( "Master password: FAILED to unwrap data encryption key" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), CRITICAL );
+
+    clearMasterPassword();
+    emit masterPasswordVerified( false );
+    return false;
+  }
+
+  QMutexLocker locker( &mMutex );
+  mMasterPassKeyHash = keyhash;
+  mMasterPassVerified = true;
+  mMasterPassVerifiedGeneration = mPassTableGeneration;
+
+  // configs may have failed only because there was no (valid) master password
+  mFailedConfigs.clear();
+  locker.unlock();
+
+  // only once the data key is usable too
+  emit masterPasswordVerified( true );
   return true;
 }
 
+bool QgsAuthManager::masterPasswordSessionVerified() const
+{
+  QMutexLocker locker( &mMutex );
+  return mMasterPassVerified
+         && !mMasterPass.isEmpty()
+         && mMasterPassVerifiedGeneration == mPassTableGeneration;
+}
+
+void QgsAuthManager::clearMasterPassword()
+{
+  QMutexLocker locker( &mMutex );
+  mMasterPass = QString();
+  masterPasswordSessionReset();
+}
+
 bool QgsAuthManager::masterPasswordIsSet() const
 {
+  QMutexLocker locker( &mMutex );
   return !mMasterPass.isEmpty();
 }
 
 bool QgsAuthManager::masterPasswordSame( const QString &pass ) const
 {
+  QMutexLocker locker( &mMutex );
   return mMasterPass == pass;
 }
 
@@ -474,54 +886,62 @@ bool QgsAuthManager::resetMasterPassword( const QString& newpass, const QString
   if ( isDisabled() )
     return false;
 
+  QMutexLocker passlocker( &mMasterPassMutex );
+
   // verify caller knows the current master password
   // this means that the user will have had to already set the master password as well
   if ( !masterPasswordSame( oldpass ) )
     return false;
 
-  // close any connection to current db
-  authDbConnection().close();
-
-  // duplicate current db file to 'qgis-auth_YYYY-MM-DD-HHMMSS.db' backup
-  QString datestamp( QDateTime::currentDateTime().toString( "yyyy-MM-dd-hhmmss" ) );
-  QString dbbackup( authenticationDbPath() );
-  dbbackup.replace( QString( ".db" ), QString( "_%1.db" ).arg( datestamp ) );
-
-  if ( !QFile::copy( authenticationDbPath(), dbbackup ) )
+  // make sure data key is unwrapped with the current password
+  if ( !verifyMasterPassword() || !masterPasswordLoadRow() )
   {
-    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not backup current database" );
+    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not verify current password" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
     return false;
   }
-  QgsDebugMsg( "Master password reset: backed up current database" );
 
-  // create new database and connection
-  authDbConnection();
+  if ( keepbackup )
+  {
+    QString dbbackup;
+    if ( !authDbBackup( QString(), &dbbackup ) )
+    {
+      const char* err = QT_TR_NOOP( "Master password reset FAILED: could not backup current database" );
+      QgsDebugMsg( err );
+      emit messageOut( tr( err ), authManTag(), WARNING );
+      return false;
+    }
+    QgsDebugMsg( QString( "Master password reset: backed up previous db at %1" ).arg( dbbackup ) );
+    if ( backuppath )
+      *backuppath = dbbackup;
+  }
 
-  // store current password and civ
-  QString prevpass = QString( mMasterPass );
-  QString prevciv = QString( masterPasswordCiv() );
+  // configs, identities and settings are encrypted with the data key,
+  // so only its wrapping (and the password hash) need to change
+  QMutexLocker locker( &mMutex );
+  QCA::SecureArray datakey( mDataKey );
+  QString prevpass( mMasterPass );
+  QString prevsalt( mPassSalt );
+  QString prevciv( mPassCiv );
+  QString prevhash( mPassHash );
+  QString prevdek( mPassDek );
+  locker.unlock();
 
-  // on ANY FAILURE from this point, reinstate previous password and database
-  bool ok = true;
+  QString salt, hash;
+  QgsAuthCrypto::passwordKeyHash( newpass, &salt, &hash );
+  QString dek( QgsAuthCrypto::wrapDataKey( newpass, datakey ) );
 
-  // clear password hash table (also clears mMasterPass)
-  if ( ok && !masterPasswordClearDb() )
+  // on ANY FAILURE from this point, reinstate previous password record
+  bool ok = !salt.isEmpty() && !hash.isEmpty() && !dek.isEmpty();
+  if ( !ok )
   {
-    ok = false;
-    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not clear current password from database" );
+    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not wrap data key with new password" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
   }
-  if ( ok )
-    QgsDebugMsg( "Master password reset: cleared current password from database" );
-
-  // mMasterPass empty, set new password (don't verify, since not stored yet)
-  setMasterPassword( newpass, false );
 
-  // store new password hash
-  if ( ok && !masterPasswordStoreInDb() )
+  if ( ok && !masterPasswordWriteRow( salt, prevciv, hash, dek, true ) )
   {
     ok = false;
     const char* err = QT_TR_NOOP( "Master password reset FAILED: could not store new password in database" );
@@ -529,7 +949,13 @@ bool QgsAuthManager::resetMasterPassword( const QString& newpass, const QString
     emit messageOut( tr( err ), authManTag(), WARNING );
   }
   if ( ok )
-    QgsDebugMsg( "Master password reset: stored new password in database" );
+  {
+    QgsDebugMsg( "Master password reset: stored new password and re-wrapped data key in database" );
+    locker.relock();
+    masterPasswordSessionReset();
+    mMasterPass = newpass;
+    locker.unlock();
+  }
 
   // verify it stored password properly
   if ( ok && !verifyMasterPassword() )
@@ -540,71 +966,34 @@ bool QgsAuthManager::resetMasterPassword( const QString& newpass, const QString
     emit messageOut( tr( err ), authManTag(), WARNING );
   }
 
-  // re-encrypt everything with new password
-  if ( ok && !reencryptAllAuthenticationConfigs( prevpass, prevciv ) )
-  {
-    ok = false;
-    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not re-encrypt configs in database" );
-    QgsDebugMsg( err );
-    emit messageOut( tr( err ), authManTag(), WARNING );
-  }
-  if ( ok )
-    QgsDebugMsg( "Master password reset: re-encrypted configs in database" );
-
   // verify it all worked
   if ( ok && !verifyPasswordCanDecryptConfigs() )
   {
     ok = false;
-    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not verify password can decrypt re-encrypted configs" );
+    const char* err = QT_TR_NOOP( "Master password reset FAILED: could not verify password can decrypt configs" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
   }
 
-  // something went wrong, reinstate previous password and database
+  // something went wrong, reinstate previous password
   if ( !ok )
   {
-    // backup database of failed attempt, for inspection
-    authDbConnection().close();
-    QString errdbbackup( dbbackup );
-    errdbbackup.replace( QString( ".db" ), QString( "_ERROR.db" ) );
-    QFile::rename( authenticationDbPath(), errdbbackup );
-    QgsDebugMsg( QString( "Master password reset FAILED: backed up failed db at %1" ).arg( errdbbackup ) );
-
-    // reinstate previous database and password
-    QFile::rename( dbbackup, authenticationDbPath() );
+    masterPasswordWriteRow( prevsalt, prevciv, prevhash, prevdek, true );
+    locker.relock();
+    masterPasswordSessionReset();
     mMasterPass = prevpass;
-    authDbConnection();
-    QgsDebugMsg( "Master password reset FAILED: reinstated previous password and database" );
-
-    // assign error db backup
-    if ( backuppath )
-      *backuppath = errdbbackup;
-
+    locker.unlock();
+    QgsDebugMsg( "Master password reset FAILED: reinstated previous password" );
     return false;
   }
 
-
-  if ( !keepbackup && !QFile::remove( dbbackup ) )
-  {
-    const char* err = QT_TR_NOOP( "Master password reset: could not remove old database backup" );
-    QgsDebugMsg( err );
-    emit messageOut( tr( err ), authManTag(), WARNING );
-    // a non-blocking error, continue
-  }
-
-  if ( keepbackup )
-  {
-    QgsDebugMsg( QString( "Master password reset: backed up previous db at %1" ).arg( dbbackup ) );
-    if ( backuppath )
-      *backuppath = dbbackup;
-  }
-
   QgsDebugMsg( "Master password reset: SUCCESS" );
   return true;
 }
 
 void QgsAuthManager::registerProviders()
 {
+  QMutexLocker locker( &mMutex );
   if ( isDisabled() )
     return;
 
@@ -722,17 +1111,20 @@ void QgsAuthManager::updateConfigProviderTypes()
   if ( query.isActive() )
   {
     QgsDebugMsg( "Synching existing auth config provider types" );
-    mConfigProviders.clear();
+    QHash<QString, QgsAuthType::ProviderType> configproviders;
     while ( query.next() )
     {
-      mConfigProviders.insert( query.value( 0 ).toString(),
-                               QgsAuthType::stringToType( query.value( 1 ).toString() ) );
+      configproviders.insert( query.value( 0 ).toString(),
+                              QgsAuthType::stringToType( query.value( 1 ).toString() ) );
     }
+    QMutexLocker locker( &mMutex );
+    mConfigProviders = configproviders;
   }
 }
 
 QgsAuthProvider* QgsAuthManager::configProvider( const QString& authcfg )
 {
+  QMutexLocker locker( &mMutex );
   if ( isDisabled() )
     return 0;
 
@@ -755,6 +1147,7 @@ QgsAuthProvider* QgsAuthManager::configProvider( const QString& authcfg )
 
 QgsAuthType::ProviderType QgsAuthManager::configProviderType( const QString& authcfg )
 {
+  QMutexLocker locker( &mMutex );
   if ( isDisabled() )
     return QgsAuthType::Unknown;
 
@@ -806,7 +1199,7 @@ bool QgsAuthManager::storeAuthenticationConfig( QgsAuthConfigBase &config )
   query.bindValue( ":uri", config.uri() );
   query.bindValue( ":type", config.typeToString() );
   query.bindValue( ":version", config.version() );
-  query.bindValue( ":config", QgsAuthCrypto::encrypt( mMasterPass, masterPasswordCiv(), configstring ) );
+  query.bindValue( ":config", encryptDataBlob( configstring ) );
 
   if ( !authDbStartTransaction() )
     return false;
@@ -819,6 +1212,7 @@ bool QgsAuthManager::storeAuthenticationConfig( QgsAuthConfigBase &config )
 
   // passed-in config should now be like as if it was just loaded from db
   config.setId( uid );
+  mFailedConfigs.remove( uid );
 
   updateConfigProviderTypes();
 
@@ -875,7 +1269,7 @@ bool QgsAuthManager::updateAuthenticationConfig( const QgsAuthConfigBase& config
   query.bindValue( ":uri", config.uri() );
   query.bindValue( ":type", config.typeToString() );
   query.bindValue( ":version", config.version() );
-  query.bindValue( ":config", QgsAuthCrypto::encrypt( mMasterPass, masterPasswordCiv(), configstring ) );
+  query.bindValue( ":config", encryptDataBlob( configstring ) );
 
   if ( !authDbStartTransaction() )
     return false;
@@ -904,45 +1298,49 @@ bool QgsAuthManager::loadAuthenticationConfig( const QString& authcfg, QgsAuthCo
   if ( full && !setMasterPassword( true ) )
     return false;
 
-  QSqlQuery query( authDbConnection() );
   full = full && config.type() != QgsAuthType::None; // negates 'full' if loading into base class
+  QString sql;
   if ( full )
   {
-    query.prepare( QString( "SELECT id, name, uri, type, version, config FROM %1 "
-                            "WHERE id = :id" ).arg( authDbConfigTable() ) );
+    sql = QString( "SELECT id, name, uri, type, version, config FROM %1 "
+                   "WHERE id = :id" ).arg( authDbConfigTable() );
   }
   else
   {
-    query.prepare( QString( "SELECT id, name, uri, type, version FROM %1 "
-                            "WHERE id = :id" ).arg( authDbConfigTable() ) );
+    sql = QString( "SELECT id, name, uri, type, version FROM %1 "
+                   "WHERE id = :id" ).arg( authDbConfigTable() );
   }
 
-  query.bindValue( ":id", authcfg );
+  QgsAuthDbStatement query( authDbStatement( sql ) );
+  if ( !query.isValid() )
+    return false;
 
-  if ( !authDbQuery( &query ) )
+  query->bindValue( ":id", authcfg );
+
+  if ( !authDbQuery( query.query() ) )
   {
     return false;
   }
 
-  if ( query.isActive() && query.isSelect() )
+  if ( query->isActive() && query->isSelect() )
   {
-    if ( query.first() )
+    if ( query->first() )
     {
-      config.setId( query.value( 0 ).toString() );
-      config.setName( query.value( 1 ).toString() );
-      config.setUri( query.value( 2 ).toString() );
-      config.setType( QgsAuthType::stringToType( query.value( 3 ).toString() ) );
-      config.setVersion( query.value( 4 ).toInt() );
+      config.setId( query->value( 0 ).toString() );
+      config.setName( query->value( 1 ).toString() );
+      config.setUri( query->value( 2 ).toString() );
+      config.setType( QgsAuthType::stringToType( query->value( 3 ).toString() ) );
+      config.setVersion( query->value( 4 ).toInt() );
 
       if ( full )
       {
-        config.loadConfigString( QgsAuthCrypto::decrypt( mMasterPass, masterPasswordCiv(), query.value( 5 ).toString() ) );
+        config.loadConfigString( decryptDataBlob( query->value( 5 ) ) );
       }
 
       QgsDebugMsg( QString( "Load %1 config SUCCESS for authcfg: %2" ).arg( full ? "full" : "base" ) .arg( authcfg ) );
       return true;
     }
-    if ( query.next() )
+    if ( query->next() )
     {
       QgsDebugMsg( QString( "Select contains more than one for authcfg: %1" ).arg( authcfg ) );
       emit messageOut( tr( "Authentication database contains duplicate configuration IDs" ), authManTag(), WARNING );
@@ -1018,17 +1416,27 @@ bool QgsAuthManager::updateNetworkRequest( QNetworkRequest &request, const QStri
   if ( isDisabled() )
     return false;
 
+  QgsAuthFailure failure;
+  if ( cachedFailure( authcfg, &failure ) )
+  {
+    QgsDebugMsg( QString( "Update request SKIPPED for authcfg %1, recently failed: %2" ).arg( authcfg ).arg( failure.reason() ) );
+    return false;
+  }
+
   QgsAuthProvider* provider = configProvider( authcfg );
   if ( provider )
   {
     if ( !provider->updateNetworkRequest( request, authcfg ) )
     {
       provider->clearCachedConfig( authcfg );
+      failure = provider->takeFailure( authcfg );
+      cacheFailure( authcfg, !failure.isNull() ? failure : QgsAuthFailure( tr( "Provider could not apply config" ) ) );
       return false;
     }
     return true;
   }
   QgsDebugMsg( QString( "No provider returned for authcfg: %1" ).arg( authcfg ) );
+  cacheFailure( authcfg, QgsAuthFailure( tr( "No provider for config, or config does not exist" ) ) );
   return false;
 }
 
@@ -1051,32 +1459,286 @@ bool QgsAuthManager::updateNetworkReply( QNetworkReply *reply, const QString& au
   return false;
 }
 
-bool QgsAuthManager::storeAuthSetting( const QString &key, QVariant value, bool encrypt )
+const QString QgsAuthManager::authenticationFailureReason( const QString& authcfg )
 {
-  if ( key.isEmpty() )
+  QgsAuthFailure failure;
+  return cachedFailure( authcfg, &failure ) ? failure.reason() : QString();
+}
+
+bool QgsAuthManager::cachedFailure( const QString& authcfg, QgsAuthFailure *failure )
+{
+  if ( mFailedConfigTtl <= 0 || !mFailedConfigs.lookup( authcfg, failure ) )
     return false;
 
-  QString storeval( value.toString() );
-  if ( encrypt )
+  if ( QDateTime::currentMSecsSinceEpoch() - failure->created() > mFailedConfigTtl * 1000
+       || failure->filesChanged() )
   {
-    if ( !setMasterPassword( true ) )
-    {
-      return false;
-    }
-    else
-    {
-      storeval = QgsAuthCrypto::encrypt( mMasterPass, masterPasswordCiv(), value.toString() );
-    }
+    mFailedConfigs.remove( authcfg );
+    return false;
   }
+  return true;
+}
 
-  removeAuthSetting( key );
+void QgsAuthManager::cacheFailure( const QString& authcfg, const QgsAuthFailure& failure )
+{
+  if ( mFailedConfigTtl <= 0 )
+    return;
+
+  mFailedConfigs.insert( authcfg, failure );
+}
+
+void QgsAuthManager::watchConfigFiles( const QString& authcfg, const QStringList& files )
+{
+  QStringList added;
+  {
+    QMutexLocker locker( &mWatchMutex );
+    Q_FOREACH ( const QString& file, files )
+    {
+      if ( file.isEmpty() )
+        continue;
+      QString path( QFileInfo( file ).absoluteFilePath() );
+      if ( !mWatchedFileConfigs.contains( path ) )
+      {
+        mWatchedFileStates.insert( path, fileState_( path ) );
+        added << path;
+      }
+      mWatchedFileConfigs[path].insert( authcfg );
+    }
+  }
+  if ( !added.isEmpty() )
+  {
+    // the watcher belongs to the manager's thread
+    QMetaObject::invokeMethod( this, "addWatchedFiles", Qt::QueuedConnection, Q_ARG( QStringList, added ) );
+  }
+}
+
+void QgsAuthManager::unwatchConfigFiles( const QString& authcfg )
+{
+  QStringList removed;
+  {
+    QMutexLocker locker( &mWatchMutex );
+    QHash<QString, QSet<QString> >::iterator it = mWatchedFileConfigs.begin();
+    while ( it != mWatchedFileConfigs.end() )
+    {
+      it.value().remove( authcfg );
+      if ( it.value().isEmpty() )
+      {
+        mWatchedFileStates.remove( it.key() );
+        removed << it.key();
+        it = mWatchedFileConfigs.erase( it );
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+  if ( !removed.isEmpty() )
+  {
+    QMetaObject::invokeMethod( this, "removeWatchedFiles", Qt::QueuedConnection, Q_ARG( QStringList, removed ) );
+  }
+}
+
+void QgsAuthManager::addWatchedFiles( const QStringList& files )
+{
+  Q_FOREACH ( const QString& path, files )
+  {
+    // also watch the directory, to notice files replaced by rename, as rotation tools often do
+    QString dir( QFileInfo( path ).absolutePath() );
+    if ( !mFileWatcher->directories().contains( dir ) )
+      mFileWatcher->addPath( dir );
+    if ( QFile::exists( path ) && !mFileWatcher->files().contains( path ) )
+      mFileWatcher->addPath( path );
+  }
+}
+
+void QgsAuthManager::removeWatchedFiles( const QStringList& files )
+{
+  QSet<QString> watcheddirs;
+  {
+    QMutexLocker locker( &mWatchMutex );
+    Q_FOREACH ( const QString& path, mWatchedFileConfigs.keys() )
+    {
+      watcheddirs.insert( QFileInfo( path ).absolutePath() );
+    }
+  }
+
+  Q_FOREACH ( const QString& path, files )
+  {
+    {
+      QMutexLocker locker( &mWatchMutex );
+      // re-watched since removal was queued
+      if ( mWatchedFileConfigs.contains( path ) )
+        continue;
+    }
+    if ( mFileWatcher->files().contains( path ) )
+      mFileWatcher->removePath( path );
+    QString dir( QFileInfo( path ).absolutePath() );
+    if ( !watcheddirs.contains( dir ) && mFileWatcher->directories().contains( dir ) )
+      mFileWatcher->removePath( dir );
+  }
+}
+
+void QgsAuthManager::watchedFileChanged( const QString& path )
+{
+  // a replaced or removed file is no longer watched; watch its replacement
+  if ( QFile::exists( path ) && !mFileWatcher->files().contains( path ) )
+    mFileWatcher->addPath( path );
+
+  refreshChangedFiles( QStringList() << path );
+}
+
+void QgsAuthManager::watchedDirectoryChanged( const QString& path )
+{
+  QStringList paths;
+  {
+    QMutexLocker locker( &mWatchMutex );
+    Q_FOREACH ( const QString& file, mWatchedFileConfigs.keys() )
+    {
+      if ( QFileInfo( file ).absolutePath() == path )
+        paths << file;
+    }
+  }
+  Q_FOREACH ( const QString& file, paths )
+  {
+    if ( QFile::exists( file ) && !mFileWatcher->files().contains( file ) )
+      mFileWatcher->addPath( file );
+  }
+
+  refreshChangedFiles( paths );
+}
+
+void QgsAuthManager::refreshChangedFiles( const QStringList& paths )
+{
+  QSet<QString> authcfgs;
+  {
+    QMutexLocker locker( &mWatchMutex );
+    Q_FOREACH ( const QString& path, paths )
+    {
+      if ( !mWatchedFileConfigs.contains( path ) )
+        continue;
+      QString state( fileState_( path ) );
+      if ( state == mWatchedFileStates.value( path ) )
+        continue;
+      mWatchedFileStates.insert( path, state );
+      authcfgs += mWatchedFileConfigs.value( path );
+    }
+  }
+  if ( authcfgs.isEmpty() )
+    return;
+
+  QStringList changed( authcfgs.toList() );
+  QgsDebugMsg( QString( "Files changed for cached configs: %1" ).arg( changed.join( ", " ) ) );
+
+  // only drop affected configs; they stay watched, and are rebuilt unless that needs a password prompt
+  bool rebuild = masterPasswordIsSet();
+  Q_FOREACH ( const QString& authcfg, changed )
+  {
+    mFailedConfigs.remove( authcfg );
+    QgsAuthProvider* provider = configProvider( authcfg );
+    if ( !provider )
+      continue;
+    provider->clearCachedConfig( authcfg );
+    if ( rebuild )
+      mRefreshPool.start( new QgsAuthWarmTask( provider, authcfg ) );
+  }
+
+  emit configFilesChanged( changed );
+}
+
+void QgsAuthManager::prewarmConfigs( const QStringList& authcfgs )
+{
+  if ( isDisabled() )
+    return;
+
+  QStringList configs( authcfgs );
+  configs.removeDuplicates();
+  configs.removeAll( QString() );
+  if ( configs.isEmpty() )
+    return;
+
+  // verify (or prompt for) master password here, so background threads never have to
+  if ( !setMasterPassword( true ) )
+  {
+    QgsDebugMsg( "Prewarm of configs SKIPPED: master password not set" );
+    return;
+  }
+
+  // batches started while one is running are merged into it
+  {
+    QMutexLocker locker( &mPrewarmMutex );
+    mPrewarmTotal += configs.size();
+  }
+  Q_FOREACH ( const QString& authcfg, configs )
+  {
+    QgsAuthProvider* provider = configProvider( authcfg );
+    if ( !provider )
+    {
+      // report asynchronously, like the others
+      QMetaObject::invokeMethod( this, "prewarmConfigDone", Qt::QueuedConnection,
+                                 Q_ARG( QString, authcfg ), Q_ARG( bool, false ), Q_ARG( int, 0 ) );
+      continue;
+    }
+    mRefreshPool.start( new QgsAuthWarmTask( provider, authcfg, this ) );
+  }
+  QgsDebugMsg( QString( "Prewarm of %1 configs started" ).arg( configs.size() ) );
+}
+
+void QgsAuthManager::prewarmConfigDone( const QString& authcfg, bool ok, int msecs )
+{
+  Q_UNUSED( msecs );
+  int done, succeeded, total;
+  bool finished;
+  {
+    QMutexLocker locker( &mPrewarmMutex );
+    ++mPrewarmDone;
+    if ( ok )
+      ++mPrewarmSucceeded;
+    done = mPrewarmDone;
+    succeeded = mPrewarmSucceeded;
+    total = mPrewarmTotal;
+    finished = mPrewarmDone >= mPrewarmTotal;
+    if ( finished )
+      mPrewarmTotal = mPrewarmDone = mPrewarmSucceeded = 0;
+  }
+
+  // signals emitted outside of the lock, as slots may start another prewarm
+  emit prewarmProgress( authcfg, ok, done, total );
+
+  if ( finished )
+  {
+    QgsDebugMsg( QString( "Prewarm of configs finished: %1 of %2 succeeded" ).arg( succeeded ).arg( total ) );
+    emit prewarmFinished( succeeded, total );
+  }
+}
+
+bool QgsAuthManager::storeAuthSetting( const QString &key, QVariant value, bool encrypt )
+{
+  if ( key.isEmpty() )
+    return false;
+
+  QString storeval( value.toString() );
+  if ( encrypt )
+  {
+    if ( !setMasterPassword( true ) )
+    {
+      return false;
+    }
+    else
+    {
+      storeval = encryptData( value.toString() );
+    }
+  }
+
+  removeAuthSetting( key );
 
   QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "INSERT INTO %1 (setting, value) "
-                          "VALUES (:setting, :value)" ).arg( authDbSettingsTable() ) );
+  query.prepare( QString( "INSERT INTO %1 (setting, value, encrypted) "
+                          "VALUES (:setting, :value, :encrypted)" ).arg( authDbSettingsTable() ) );
 
   query.bindValue( ":setting", key );
   query.bindValue( ":value", storeval );
+  query.bindValue( ":encrypted", encrypt ? 1 : 0 );
 
   if ( !authDbStartTransaction() )
     return false;
@@ -1087,6 +1749,11 @@ bool QgsAuthManager::storeAuthSetting( const QString &key, QVariant value, bool
   if ( !authDbCommit() )
     return false;
 
+#ifndef QT_NO_OPENSSL
+  if ( key.startsWith( "cafile" ) )
+    clearExtraFileCAs();
+#endif
+
   QgsDebugMsg( QString( "Store setting SUCCESS for key: %1" ).arg( key ) );
   return true;
 }
@@ -1100,30 +1767,31 @@ QVariant QgsAuthManager::getAuthSetting( const QString &key, QVariant defaultVal
     return QVariant();
 
   QVariant value = defaultValue;
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT value FROM %1 "
-                          "WHERE setting = :setting" ).arg( authDbSettingsTable() ) );
+  QgsAuthDbStatement query( authDbStatement( QString( "SELECT value FROM %1 "
+                                                      "WHERE setting = :setting" ).arg( authDbSettingsTable() ) ) );
+  if ( !query.isValid() )
+    return QVariant();
 
-  query.bindValue( ":setting", key );
+  query->bindValue( ":setting", key );
 
-  if ( !authDbQuery( &query ) )
+  if ( !authDbQuery( query.query() ) )
     return QVariant();
 
-  if ( query.isActive() && query.isSelect() )
+  if ( query->isActive() && query->isSelect() )
   {
-    if ( query.first() )
+    if ( query->first() )
     {
       if ( decrypt )
       {
-        value = QVariant( QgsAuthCrypto::decrypt( mMasterPass, masterPasswordCiv(), query.value( 0 ).toString() ) );
+        value = QVariant( decryptData( query->value( 0 ).toString() ) );
       }
       else
       {
-        value = query.value( 0 );
+        value = query->value( 0 );
       }
       QgsDebugMsg( QString( "Authentication setting retrieved for key: %1" ).arg( key ) );
     }
-    if ( query.next() )
+    if ( query->next() )
     {
       QgsDebugMsg( QString( "Select contains more than one for setting key: %1" ).arg( key ) );
       emit messageOut( tr( "Authentication database contains duplicate settings" ), authManTag(), WARNING );
@@ -1185,6 +1853,11 @@ bool QgsAuthManager::removeAuthSetting( const QString& key )
   if ( !authDbCommit() )
     return false;
 
+#ifndef QT_NO_OPENSSL
+  if ( key.startsWith( "cafile" ) )
+    clearExtraFileCAs();
+#endif
+
   QgsDebugMsg( QString( "REMOVED setting for key: %1" ).arg( key ) );
 
   return true;
@@ -1214,16 +1887,16 @@ bool QgsAuthManager::storeCertIdentity( const QSslCertificate &cert, const QSslK
   QString id( QgsAuthCertUtils::shaHexForCert( cert ) );
   removeCertIdentity( id );
 
-  QString certpem( cert.toPem() );
-  QString keypem( QgsAuthCrypto::encrypt( mMasterPass, masterPasswordCiv(), key.toPem() ) );
+  QByteArray certder( cert.toDer() );
+  QByteArray keydata( encryptDataBlob( key.toPem() ) );
 
   QSqlQuery query( authDbConnection() );
   query.prepare( QString( "INSERT INTO %1 (id, key, cert) "
                           "VALUES (:id, :key, :cert)" ).arg( authDbIdentitiesTable() ) );
 
   query.bindValue( ":id", id );
-  query.bindValue( ":key", keypem );
-  query.bindValue( ":cert", certpem );
+  query.bindValue( ":key", keydata );
+  query.bindValue( ":cert", certder );
 
   if ( !authDbStartTransaction() )
     return false;
@@ -1234,41 +1907,75 @@ bool QgsAuthManager::storeCertIdentity( const QSslCertificate &cert, const QSslK
   if ( !authDbCommit() )
     return false;
 
+  clearCertIdentities();
+  // identity configs that failed for lack of this identity can now be retried
+  mFailedConfigs.clear();
+  bumpSslConfigGeneration();
+
   QgsDebugMsg( QString( "Store certificate identity SUCCESS for id: %1" ).arg( id ) );
   return true;
 }
 
-const QSslCertificate QgsAuthManager::getCertIdentity( const QString &id )
+bool QgsAuthManager::loadCertIdentities()
 {
-  QSslCertificate emptycert;
-  QSslCertificate cert;
-  if ( id.isEmpty() )
-    return emptycert;
+  // with mIdentitiesMutex held
+  if ( mIdentitiesLoaded )
+    return true;
 
   QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT cert FROM %1 "
-                          "WHERE id = :id" ).arg( authDbIdentitiesTable() ) );
-
-  query.bindValue( ":id", id );
+  query.prepare( QString( "SELECT id, key, cert FROM %1" ).arg( authDbIdentitiesTable() ) );
 
   if ( !authDbQuery( &query ) )
-    return emptycert;
+    return false;
 
+  mIdentities.clear();
   if ( query.isActive() && query.isSelect() )
   {
-    if ( query.first() )
-    {
-      cert = QSslCertificate( query.value( 0 ).toByteArray(), QSsl::Pem );
-      QgsDebugMsg( QString( "Certificate identity retrieved for id: %1" ).arg( id ) );
-    }
-    if ( query.next() )
+    while ( query.next() )
     {
-      QgsDebugMsg( QString( "Select contains more than one certificate identity for id: %1" ).arg( id ) );
-      emit messageOut( tr( "Authentication database contains duplicate certificate identity" ), authManTag(), WARNING );
-      return emptycert;
+      IdentityEntry entry;
+      entry.cert = certFromDbValue( query.value( 2 ) );
+      if ( entry.cert.isNull() )
+      {
+        QgsDebugMsg( QString( "Certificate identity SKIPPED, could not create certificate for id: %1" ).arg( query.value( 0 ).toString() ) );
+        continue;
+      }
+      QString org( entry.cert.subjectInfo( QSslCertificate::Organization ) );
+      if ( org.isEmpty() )
+        org = tr( "Organization not defined" );
+      entry.name = QString( "%1 (%2)" ).arg( QgsAuthCertUtils::resolvedCertName( entry.cert ) ).arg( org );
+      // kept as stored: hex text rows, not (yet) migrated to BLOB storage, are tolerated by decryptDataBlob
+      entry.keyBlob = query.value( 1 );
+      mIdentities.insert( query.value( 0 ).toString(), entry );
     }
   }
-  return cert;
+  mIdentitiesLoaded = true;
+  QgsDebugMsg( QString( "Certificate identities loaded: %1" ).arg( mIdentities.size() ) );
+  return true;
+}
+
+void QgsAuthManager::clearCertIdentities()
+{
+  QMutexLocker locker( &mIdentitiesMutex );
+  mIdentities.clear();
+  mIdentitiesLoaded = false;
+}
+
+const QSslCertificate QgsAuthManager::getCertIdentity( const QString &id )
+{
+  if ( id.isEmpty() )
+    return QSslCertificate();
+
+  QMutexLocker locker( &mIdentitiesMutex );
+  if ( !loadCertIdentities() )
+    return QSslCertificate();
+
+  QMap<QString, IdentityEntry>::const_iterator it = mIdentities.constFind( id );
+  if ( it == mIdentities.constEnd() )
+    return QSslCertificate();
+
+  QgsDebugMsg( QString( "Certificate identity retrieved for id: %1" ).arg( id ) );
+  return it.value().cert;
 }
 
 const QPair<QSslCertificate, QSslKey> QgsAuthManager::getCertIdentityBundle( const QString &id )
@@ -1280,48 +1987,52 @@ const QPair<QSslCertificate, QSslKey> QgsAuthManager::getCertIdentityBundle( con
   if ( !setMasterPassword( true ) )
     return bundle;
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT key, cert FROM %1 "
-                          "WHERE id = :id" ).arg( authDbIdentitiesTable() ) );
+  QSslCertificate cert;
+  QVariant keyblob;
+  int generation = mIdentityKeyGeneration;
+  {
+    QMutexLocker locker( &mIdentitiesMutex );
+    if ( !loadCertIdentities() )
+      return bundle;
 
-  query.bindValue( ":id", id );
+    QMap<QString, IdentityEntry>::const_iterator it = mIdentities.constFind( id );
+    if ( it == mIdentities.constEnd() )
+      return bundle;
 
-  if ( !authDbQuery( &query ) )
+    const IdentityEntry& entry = it.value();
+    if ( entry.keyGeneration == generation && !entry.key.isNull() )
+    {
+      QgsDebugMsg( QString( "Certificate identity bundle retrieved from cache for id: %1" ).arg( id ) );
+      return qMakePair( entry.cert, entry.key );
+    }
+    cert = entry.cert;
+    keyblob = entry.keyBlob;
+  }
+
+  // decrypt outside of identities lock, as decryption takes the session lock
+  QString keyalg;
+  QSslKey key( QgsAuthCertUtils::keyFromData( decryptDataBlob( keyblob ).toAscii(), QString(), &keyalg ) );
+  if ( key.isNull() )
+  {
+    const char* err = QT_TR_NOOP( "Retieve certificate identity bundle: FAILED to create private key" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), WARNING );
     return bundle;
+  }
 
-  if ( query.isActive() && query.isSelect() )
   {
-    QSslCertificate cert;
-    QSslKey key;
-    if ( query.first() )
-    {
-      key =  QSslKey( QgsAuthCrypto::decrypt( mMasterPass, masterPasswordCiv(), query.value( 0 ).toString() ).toAscii(),
-                      QSsl::Rsa, QSsl::Pem, QSsl::PrivateKey );
-      if ( key.isNull() )
-      {
-        const char* err = QT_TR_NOOP( "Retieve certificate identity bundle: FAILED to create private key" );
-        QgsDebugMsg( err );
-        emit messageOut( tr( err ), authManTag(), WARNING );
-        return bundle;
-      }
-      cert = QSslCertificate( query.value( 1 ).toByteArray(), QSsl::Pem );
-      if ( cert.isNull() )
-      {
-        const char* err = QT_TR_NOOP( "Retieve certificate identity bundle: FAILED to create certificate" );
-        QgsDebugMsg( err );
-        emit messageOut( tr( err ), authManTag(), WARNING );
-        return bundle;
-      }
-      QgsDebugMsg( QString( "Certificate identity bundle retrieved for id: %1" ).arg( id ) );
-    }
-    if ( query.next() )
+    QMutexLocker locker( &mIdentitiesMutex );
+    QMap<QString, IdentityEntry>::iterator it = mIdentities.find( id );
+    // identity may have been removed or replaced meanwhile; only keep key for the cert it was read with
+    if ( it != mIdentities.end() && it.value().cert == cert && generation == ( int )mIdentityKeyGeneration )
     {
-      QgsDebugMsg( QString( "Select contains more than one certificate identity for id: %1" ).arg( id ) );
-      emit messageOut( tr( "Authentication database contains duplicate certificate identity" ), authManTag(), WARNING );
-      return bundle;
+      it.value().key = key;
+      it.value().keyGeneration = generation;
     }
-    bundle = qMakePair( cert, key );
   }
+
+  QgsDebugMsg( QString( "Certificate identity bundle retrieved for id: %1 (%2 key)" ).arg( id ).arg( keyalg ) );
+  bundle = qMakePair( cert, key );
   return bundle;
 }
 
@@ -1329,52 +2040,46 @@ const QList<QSslCertificate> QgsAuthManager::getCertIdentities()
 {
   QList<QSslCertificate> certs;
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT id, cert FROM %1" ).arg( authDbIdentitiesTable() ) );
-
-  if ( !authDbQuery( &query ) )
+  QMutexLocker locker( &mIdentitiesMutex );
+  if ( !loadCertIdentities() )
     return certs;
 
-  if ( query.isActive() && query.isSelect() )
+  QMap<QString, IdentityEntry>::const_iterator it = mIdentities.constBegin();
+  for ( ; it != mIdentities.constEnd(); ++it )
   {
-    while ( query.next() )
-    {
-      certs << QSslCertificate( query.value( 1 ).toByteArray(), QSsl::Pem );
-    }
+    certs << it.value().cert;
   }
-
   return certs;
 }
 
+const QMap<QString, QString> QgsAuthManager::getCertIdentityNames()
+{
+  QMap<QString, QString> names;
+
+  QMutexLocker locker( &mIdentitiesMutex );
+  if ( !loadCertIdentities() )
+    return names;
+
+  QMap<QString, IdentityEntry>::const_iterator it = mIdentities.constBegin();
+  for ( ; it != mIdentities.constEnd(); ++it )
+  {
+    names.insert( it.key(), it.value().name );
+  }
+  return names;
+}
+
 bool QgsAuthManager::existsCertIdentity( const QString &id )
 {
   if ( id.isEmpty() )
     return false;
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT cert FROM %1 "
-                          "WHERE id = :id" ).arg( authDbIdentitiesTable() ) );
-
-  query.bindValue( ":id", id );
-
-  if ( !authDbQuery( &query ) )
+  QMutexLocker locker( &mIdentitiesMutex );
+  if ( !loadCertIdentities() )
     return false;
 
-  bool res = false;
-  if ( query.isActive() && query.isSelect() )
-  {
-    if ( query.first() )
-    {
-      QgsDebugMsg( QString( "Certificate bundle exists for id: %1" ).arg( id ) );
-      res = true;
-    }
-    if ( query.next() )
-    {
-      QgsDebugMsg( QString( "Select contains more than one certificate bundle for id: %1" ).arg( id ) );
-      emit messageOut( tr( "Authentication database contains duplicate certificate bundles" ), authManTag(), WARNING );
-      return false;
-    }
-  }
+  bool res = mIdentities.contains( id );
+  if ( res )
+    QgsDebugMsg( QString( "Certificate bundle exists for id: %1" ).arg( id ) );
   return res;
 }
 
@@ -1401,6 +2106,9 @@ bool QgsAuthManager::removeCertIdentity( const QString &id )
   if ( !authDbCommit() )
     return false;
 
+  clearCertIdentities();
+  bumpSslConfigGeneration();
+
   QgsDebugMsg( QString( "REMOVED certificate identity for id: %1" ).arg( id ) );
   return true;
 }
@@ -1418,7 +2126,7 @@ bool QgsAuthManager::storeSslCertCustomConfig( const QgsAuthConfigSslServer &con
   QString id( QgsAuthCertUtils::shaHexForCert( cert ) );
   removeSslCertCustomConfig( id );
 
-  QString certpem( cert.toPem() );
+  QByteArray certder( cert.toDer() );
 
   QSqlQuery query( authDbConnection() );
   query.prepare( QString( "INSERT INTO %1 (id, host, cert, config) "
@@ -1426,7 +2134,7 @@ bool QgsAuthManager::storeSslCertCustomConfig( const QgsAuthConfigSslServer &con
 
   query.bindValue( ":id", id );
   query.bindValue( ":host", config.sslHost().trimmed() );
-  query.bindValue( ":cert", certpem );
+  query.bindValue( ":cert", certder );
   query.bindValue( ":config", config.configString() );
 
   if ( !authDbStartTransaction() )
@@ -1438,6 +2146,8 @@ bool QgsAuthManager::storeSslCertCustomConfig( const QgsAuthConfigSslServer &con
   if ( !authDbCommit() )
     return false;
 
+  bumpSslConfigGeneration();
+
   QgsDebugMsg( QString( "Store SSL cert custom config SUCCESS for id: %1" ).arg( id ) );
   return true;
 }
@@ -1462,7 +2172,7 @@ const QgsAuthConfigSslServer QgsAuthManager::getSslCertCustomConfig( const QStri
   {
     if ( query.first() )
     {
-      config.setSslCertificate( QSslCertificate( query.value( 2 ).toByteArray(), QSsl::Pem ) );
+      config.setSslCertificate( certFromDbValue( query.value( 2 ) ) );
       config.setSslHost( query.value( 1 ).toString().trimmed() );
       config.loadConfigString( query.value( 3 ).toString() );
       QgsDebugMsg( QString( "SSL cert custom config retrieved for id: %1" ).arg( id ) );
@@ -1485,25 +2195,26 @@ const QgsAuthConfigSslServer QgsAuthManager::getSslCertCustomConfigByHost( const
   if ( hostport.isEmpty() )
     return config;
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT id, host, cert, config FROM %1 "
-                          "WHERE host = :host" ).arg( authDbServersTable() ) );
+  QgsAuthDbStatement query( authDbStatement( QString( "SELECT id, host, cert, config FROM %1 "
+                                                      "WHERE host = :host" ).arg( authDbServersTable() ) ) );
+  if ( !query.isValid() )
+    return config;
 
-  query.bindValue( ":host", hostport.trimmed() );
+  query->bindValue( ":host", hostport.trimmed() );
 
-  if ( !authDbQuery( &query ) )
+  if ( !authDbQuery( query.query() ) )
     return config;
 
-  if ( query.isActive() && query.isSelect() )
+  if ( query->isActive() && query->isSelect() )
   {
-    if ( query.first() )
+    if ( query->first() )
     {
-      config.setSslCertificate( QSslCertificate( query.value( 2 ).toByteArray(), QSsl::Pem ) );
-      config.setSslHost( query.value( 1 ).toString().trimmed() );
-      config.loadConfigString( query.value( 3 ).toString() );
+      config.setSslCertificate( certFromDbValue( query->value( 2 ) ) );
+      config.setSslHost( query->value( 1 ).toString().trimmed() );
+      config.loadConfigString( query->value( 3 ).toString() );
       QgsDebugMsg( QString( "SSL cert custom config retrieved for host:port: %1" ).arg( hostport ) );
     }
-    if ( query.next() )
+    if ( query->next() )
     {
       QgsDebugMsg( QString( "Select contains more than one SSL cert custom config for host:port: %1" ).arg( hostport ) );
       emit messageOut( tr( "Authentication database contains duplicate SSL cert custom configs" ), authManTag(), WARNING );
@@ -1529,7 +2240,7 @@ const QList<QgsAuthConfigSslServer> QgsAuthManager::getSslCertCustomConfigs()
     while ( query.next() )
     {
       QgsAuthConfigSslServer config;
-      config.setSslCertificate( QSslCertificate( query.value( 2 ).toByteArray(), QSsl::Pem ) );
+      config.setSslCertificate( certFromDbValue( query.value( 2 ) ) );
       config.setSslHost( query.value( 1 ).toString().trimmed() );
       config.loadConfigString( query.value( 3 ).toString() );
 
@@ -1595,6 +2306,8 @@ bool QgsAuthManager::removeSslCertCustomConfig( const QString &id )
   if ( !authDbCommit() )
     return false;
 
+  bumpSslConfigGeneration();
+
   QgsDebugMsg( QString( "REMOVED SSL cert custom config for id: %1" ).arg( id ) );
   return true;
 }
@@ -1629,14 +2342,14 @@ bool QgsAuthManager::storeCertAuthority( const QSslCertificate& cert )
   removeCertAuthority( cert );
 
   QString id( QgsAuthCertUtils::shaHexForCert( cert ) );
-  QString pem( cert.toPem() );
+  QByteArray der( cert.toDer() );
 
   QSqlQuery query( authDbConnection() );
   query.prepare( QString( "INSERT INTO %1 (id, cert) "
                           "VALUES (:id, :cert)" ).arg( authDbAuthoritiesTable() ) );
 
   query.bindValue( ":id", id );
-  query.bindValue( ":cert", pem );
+  query.bindValue( ":cert", der );
 
   if ( !authDbStartTransaction() )
     return false;
@@ -1647,6 +2360,8 @@ bool QgsAuthManager::storeCertAuthority( const QSslCertificate& cert )
   if ( !authDbCommit() )
     return false;
 
+  insertCaCertInCache( QgsAuthCertUtils::InDatabase, QList<QSslCertificate>() << cert );
+
   QgsDebugMsg( QString( "Store certificate authority SUCCESS for id: %1" ).arg( id ) );
   return true;
 }
@@ -1671,7 +2386,7 @@ const QSslCertificate QgsAuthManager::getCertAuthority( const QString &id )
   {
     if ( query.first() )
     {
-      cert = QSslCertificate( query.value( 0 ).toByteArray(), QSsl::Pem );
+      cert = certFromDbValue( query.value( 0 ) );
       QgsDebugMsg( QString( "Certificate authority retrieved for id: %1" ).arg( id ) );
     }
     if ( query.next() )
@@ -1746,6 +2461,8 @@ bool QgsAuthManager::removeCertAuthority( const QSslCertificate& cert )
   if ( !authDbCommit() )
     return false;
 
+  removeCaCertFromCache( id );
+
   QgsDebugMsg( QString( "REMOVED authority for id: %1" ).arg( id ) );
   return true;
 }
@@ -1759,36 +2476,141 @@ const QList<QSslCertificate> QgsAuthManager::getSystemRootCAs()
 const QList<QSslCertificate> QgsAuthManager::getExtraFileCAs()
 {
   QList<QSslCertificate> certs;
-  QList<QSslCertificate> filecerts;
-  QVariant cafileval = QgsAuthManager::instance()->getAuthSetting( QString( "cafile" ) );
-  if ( cafileval.isNull() )
+  // settings, file and db cache are read without mMutex held
+  QMutexLocker locker( &mMutex );
+  if ( !mCaFileSettingsLoaded )
+  {
+    locker.unlock();
+    QVariant cafileval = getAuthSetting( QString( "cafile" ) );
+    QVariant allowinvalidval = getAuthSetting( QString( "cafileallowinvalid" ), QVariant( false ) );
+    locker.relock();
+    mCaFilePath = ( cafileval.isNull() || allowinvalidval.isNull() ) ? QString() : cafileval.toString();
+    mCaFileAllowInvalid = allowinvalidval.toBool();
+    mCaFileSettingsLoaded = true;
+  }
+  QString cafile( mCaFilePath );
+  bool allowinvalid = mCaFileAllowInvalid;
+  QString cachedkey( mExtraFileCAsKey );
+  QList<QSslCertificate> cached( mExtraFileCAs );
+  locker.unlock();
+
+  if ( cafile.isEmpty() )
     return certs;
 
-  QVariant allowinvalid = QgsAuthManager::instance()->getAuthSetting( QString( "cafileallowinvalid" ), QVariant( false ) );
-  if ( allowinvalid.isNull() )
+  QFileInfo fi( cafile );
+  if ( !fi.exists() )
     return certs;
 
-  QString cafile( cafileval.toString() );
-  if ( !cafile.isEmpty() && QFile::exists( cafile ) )
-  {
-    filecerts = QgsAuthCertUtils::certsFromFile( cafile );
-  }
-  // only CAs or certs capable of signing other certs are allowed
-  Q_FOREACH( QSslCertificate cert, filecerts )
+  // parsed and filtered certs only change with the file or the allow invalid setting
+  QString cachekey( QString( "%1|%2|%3|%4" ).arg( cafile ).arg( fi.size() )
+                    .arg( fi.lastModified().toMSecsSinceEpoch() ).arg( allowinvalid ? 1 : 0 ) );
+  bool dbcache = QSettings().value( "/qgis/auth/cafile_db_cache", true ).toBool();
+
+  if ( cachekey != cachedkey )
   {
-    if ( !allowinvalid.toBool() && !cert.isValid() )
+    cached.clear();
+    if ( dbcache && loadExtraFileCAs( cachekey, &cached ) )
     {
-      continue;
+      QgsDebugMsg( QString( "Extra file CAs loaded from db cache: %1" ).arg( cafile ) );
     }
-
-    if ( QgsAuthCertUtils::certificateIsAuthorityOrIssuer( cert ) )
+    else
     {
-      certs << cert;
+      QList<QSslCertificate> filecerts( QgsAuthCertUtils::certsFromFile( cafile ) );
+      // only CAs or certs capable of signing other certs are allowed
+      Q_FOREACH( QSslCertificate cert, filecerts )
+      {
+        if ( !allowinvalid && !cert.isValid() )
+        {
+          continue;
+        }
+
+        // by basic constraints and key usage only; trust validation would rebuild the trust
+        // collections, which in turn are built from these certs
+        QList<QgsAuthCertUtils::CertUsageType> usages( QgsAuthCertRegistry::instance()->intern( cert )->constraintUsages() );
+        if ( usages.contains( QgsAuthCertUtils::CertAuthorityUsage )
+             || usages.contains( QgsAuthCertUtils::CertIssuerUsage ) )
+        {
+          cached << cert;
+        }
+      }
+      QgsDebugMsg( QString( "Extra file CAs parsed: %1 of %2 certs from %3" ).arg( cached.size() ).arg( filecerts.size() ).arg( cafile ) );
+      if ( dbcache )
+        storeExtraFileCAs( cachekey, cached );
     }
+
+    locker.relock();
+    mExtraFileCAsKey = cachekey;
+    mExtraFileCAs = cached;
+    locker.unlock();
+  }
+
+  if ( allowinvalid )
+    return cached;
+
+  // certs may have expired since they were cached
+  Q_FOREACH( const QSslCertificate& cert, cached )
+  {
+    if ( QgsAuthCertRegistry::instance()->intern( cert )->isValid() )
+      certs << cert;
   }
   return certs;
 }
 
+void QgsAuthManager::clearExtraFileCAs()
+{
+  QMutexLocker locker( &mMutex );
+  mCaFileSettingsLoaded = false;
+  mExtraFileCAsKey.clear();
+  mExtraFileCAs.clear();
+}
+
+bool QgsAuthManager::loadExtraFileCAs( const QString& cachekey, QList<QSslCertificate> *certs )
+{
+  QSqlQuery query( authDbConnection() );
+  query.prepare( QString( "SELECT certs FROM %1 WHERE id = :id" ).arg( authDbCaFileCacheTable() ) );
+  query.bindValue( ":id", cachekey );
+
+  if ( !authDbQuery( &query ) )
+    return false;
+
+  if ( !query.isActive() || !query.isSelect() || !query.first() )
+    return false;
+
+  QByteArray der( query.value( 0 ).toByteArray() );
+  *certs = der.isEmpty() ? QList<QSslCertificate>() : QSslCertificate::fromData( der, QSsl::Der );
+  return true;
+}
+
+bool QgsAuthManager::storeExtraFileCAs( const QString& cachekey, const QList<QSslCertificate>& certs )
+{
+  QByteArray der;
+  Q_FOREACH( const QSslCertificate& cert, certs )
+  {
+    der += cert.toDer();
+  }
+
+  QSqlQuery delquery( authDbConnection() );
+  delquery.prepare( QString( "DELETE FROM %1" ).arg( authDbCaFileCacheTable() ) );
+
+  QSqlQuery query( authDbConnection() );
+  query.prepare( QString( "INSERT INTO %1 (id, certs) "
+                          "VALUES (:id, :certs)" ).arg( authDbCaFileCacheTable() ) );
+  query.bindValue( ":id", cachekey );
+  query.bindValue( ":certs", der );
+
+  if ( !authDbStartTransaction() )
+    return false;
+
+  if ( !authDbQuery( &delquery ) || !authDbQuery( &query ) )
+  {
+    authDbConnection().rollback();
+    QgsDebugMsg( "Store of extra file CAs db cache FAILED" );
+    return false;
+  }
+
+  return authDbCommit();
+}
+
 const QList<QSslCertificate> QgsAuthManager::getDatabaseCAs()
 {
   QList<QSslCertificate> certs;
@@ -1803,7 +2625,7 @@ const QList<QSslCertificate> QgsAuthManager::getDatabaseCAs()
   {
     while ( query.next() )
     {
-      certs << QSslCertificate( query.value( 1 ).toByteArray(), QSsl::Pem );
+      certs << certFromDbValue( query.value( 1 ) );
     }
   }
 
@@ -1817,11 +2639,23 @@ const QMap<QString, QSslCertificate> QgsAuthManager::getMappedDatabaseCAs()
 
 void QgsAuthManager::rebuildCaCertsCache()
 {
+  // gathered without mMutex held, since they read the system store, CA file and database
+  QList<QSslCertificate> systemcas( getSystemRootCAs() );
+  QList<QSslCertificate> filecas( getExtraFileCAs() );
+  QList<QSslCertificate> dbcas( getDatabaseCAs() );
+
+  QMutexLocker locker( &mMutex );
   mCaCertsCache.clear();
+  mShadowedCaCerts.clear();
+  for ( int i = 0; i < CaPartitionCount; ++i )
+  {
+    mCaTrustPartitions[i].clear();
+  }
+  mCaValidityRecheck = 0;
   // in reverse order of precedence, with regards to duplicates, so QMap inserts overwrite
-  insertCaCertInCache( QgsAuthCertUtils::SystemRoot, getSystemRootCAs() );
-  insertCaCertInCache( QgsAuthCertUtils::FromFile, getExtraFileCAs() );
-  insertCaCertInCache( QgsAuthCertUtils::InDatabase, getDatabaseCAs() );
+  insertCaCertInCache( QgsAuthCertUtils::SystemRoot, systemcas );
+  insertCaCertInCache( QgsAuthCertUtils::FromFile, filecas );
+  insertCaCertInCache( QgsAuthCertUtils::InDatabase, dbcas );
 }
 
 bool QgsAuthManager::storeCertTrustPolicy(const QSslCertificate &cert, QgsAuthCertUtils::CertTrustPolicy policy )
@@ -1858,6 +2692,8 @@ bool QgsAuthManager::storeCertTrustPolicy(const QSslCertificate &cert, QgsAuthCe
   if ( !authDbCommit() )
     return false;
 
+  updateCertTrustIndex( id, policy );
+
   QgsDebugMsg( QString( "Store certificate trust policy SUCCESS for id: %1" ).arg( id ) );
   return true;
 }
@@ -1872,24 +2708,25 @@ QgsAuthCertUtils::CertTrustPolicy QgsAuthManager::getCertTrustPolicy( const QSsl
 
   QString id( QgsAuthCertUtils::shaHexForCert( cert ) );
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT policy FROM %1 "
-                          "WHERE id = :id" ).arg( authDbTrustTable() ) );
+  QgsAuthDbStatement query( authDbStatement( QString( "SELECT policy FROM %1 "
+                                                      "WHERE id = :id" ).arg( authDbTrustTable() ) ) );
+  if ( !query.isValid() )
+    return QgsAuthCertUtils::DefaultTrust;
 
-  query.bindValue( ":id", id );
+  query->bindValue( ":id", id );
 
-  if ( !authDbQuery( &query ) )
+  if ( !authDbQuery( query.query() ) )
     return QgsAuthCertUtils::DefaultTrust;
 
   QgsAuthCertUtils::CertTrustPolicy policy( QgsAuthCertUtils::DefaultTrust );
-  if ( query.isActive() && query.isSelect() )
+  if ( query->isActive() && query->isSelect() )
   {
-    if ( query.first() )
+    if ( query->first() )
     {
-      policy = ( QgsAuthCertUtils::CertTrustPolicy )query.value( 0 ).toInt();
+      policy = ( QgsAuthCertUtils::CertTrustPolicy )query->value( 0 ).toInt();
       QgsDebugMsg( QString( "Authentication cert trust policy retrieved for id: %1" ).arg( id ) );
     }
-    if ( query.next() )
+    if ( query->next() )
     {
       QgsDebugMsg( QString( "Select contains more than one cert trust policy for id: %1" ).arg( id ) );
       emit messageOut( tr( "Authentication database contains duplicate cert trust policies" ), authManTag(), WARNING );
@@ -1940,6 +2777,8 @@ bool QgsAuthManager::removeCertTrustPolicy( const QSslCertificate &cert )
   if ( !authDbCommit() )
     return false;
 
+  updateCertTrustIndex( id, QgsAuthCertUtils::DefaultTrust );
+
   QgsDebugMsg( QString( "REMOVED cert trust policy for id: %1" ).arg( id ) );
 
   return true;
@@ -1952,46 +2791,71 @@ QgsAuthCertUtils::CertTrustPolicy QgsAuthManager::getCertificateTrustPolicy( con
     return QgsAuthCertUtils::NoPolicy;
   }
 
-  QString id( QgsAuthCertUtils::shaHexForCert( cert ) );
-  const QStringList& trustedids = mCertTrustCache.value( QgsAuthCertUtils::Trusted );
-  const QStringList& untrustedids = mCertTrustCache.value( QgsAuthCertUtils::Untrusted );
-
-  QgsAuthCertUtils::CertTrustPolicy policy( QgsAuthCertUtils::DefaultTrust );
-  if ( trustedids.contains( id ) )
-  {
-    policy = QgsAuthCertUtils::Trusted;
-  }
-  else if ( untrustedids.contains( id ) )
-  {
-    policy = QgsAuthCertUtils::Untrusted;
-  }
-  return policy;
+  QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+  QMutexLocker locker( &mMutex );
+  return mCertTrustPolicies.value( entry->digest(), QgsAuthCertUtils::DefaultTrust );
 }
 
 bool QgsAuthManager::setDefaultCertTrustPolicy( QgsAuthCertUtils::CertTrustPolicy policy )
 {
+  bool res;
   if ( policy == QgsAuthCertUtils::DefaultTrust )
   {
     // set default trust policy to Trusted by removing setting
-    return removeAuthSetting( "certdefaulttrust" );
+    res = removeAuthSetting( "certdefaulttrust" );
+  }
+  else
+  {
+    res = storeAuthSetting( "certdefaulttrust", ( int )policy );
   }
-  return storeAuthSetting( "certdefaulttrust", ( int )policy );
+
+  // re-read on next use
+  QMutexLocker locker( &mMutex );
+  mDefaultTrustPolicy = QgsAuthCertUtils::NoPolicy;
+  trustIndexChanged();
+  return res;
 }
 
 QgsAuthCertUtils::CertTrustPolicy QgsAuthManager::defaultCertTrustPolicy()
 {
+  QMutexLocker locker( &mMutex );
+  if ( mDefaultTrustPolicy != QgsAuthCertUtils::NoPolicy )
+    return mDefaultTrustPolicy;
+  int generation = sslConfigGeneration();
+  locker.unlock();
+
+  QgsAuthCertUtils::CertTrustPolicy defaultpolicy;
   QVariant policy( getAuthSetting( "certdefaulttrust" ) );
   if ( policy.isNull() )
   {
-    return QgsAuthCertUtils::Trusted;
+    defaultpolicy = QgsAuthCertUtils::Trusted;
   }
-  return ( QgsAuthCertUtils::CertTrustPolicy )policy.toInt();
+  else
+  {
+    defaultpolicy = ( QgsAuthCertUtils::CertTrustPolicy )policy.toInt();
+  }
+
+  // a policy change while reading leaves it to be re-read on next use
+  locker.relock();
+  if ( generation == sslConfigGeneration() )
+    mDefaultTrustPolicy = defaultpolicy;
+  return defaultpolicy;
 }
 
-bool QgsAuthManager::rebuildCertTrustCache()
+const QMap<QgsAuthCertUtils::CertTrustPolicy, QStringList > QgsAuthManager::getCertTrustCache()
 {
-  mCertTrustCache.clear();
+  QMutexLocker locker( &mMutex );
+  QMap<QgsAuthCertUtils::CertTrustPolicy, QStringList > trustcache;
+  QHash<QByteArray, QgsAuthCertUtils::CertTrustPolicy>::const_iterator it = mCertTrustPolicies.constBegin();
+  for ( ; it != mCertTrustPolicies.constEnd(); ++it )
+  {
+    trustcache[it.value()] << QString( it.key().toHex() );
+  }
+  return trustcache;
+}
 
+bool QgsAuthManager::rebuildCertTrustCache()
+{
   QSqlQuery query( authDbConnection() );
   query.prepare( QString( "SELECT id, policy FROM %1" ).arg( authDbTrustTable() ) );
 
@@ -2001,71 +2865,85 @@ bool QgsAuthManager::rebuildCertTrustCache()
     return false;
   }
 
+  QHash<QByteArray, QgsAuthCertUtils::CertTrustPolicy> policies;
   if ( query.isActive() && query.isSelect() )
   {
     while ( query.next() )
     {
-      QString id = query.value( 0 ).toString();
+      QByteArray digest( QByteArray::fromHex( query.value( 0 ).toString().toAscii() ) );
       QgsAuthCertUtils::CertTrustPolicy policy = ( QgsAuthCertUtils::CertTrustPolicy )query.value( 1 ).toInt();
-
-      QStringList ids;
-      if ( mCertTrustCache.contains( policy ) )
-      {
-        ids = mCertTrustCache.value( policy );
-      }
-      mCertTrustCache.insert( policy, ids << id );
+      policies.insert( digest, policy );
     }
   }
 
+  QMutexLocker locker( &mMutex );
+  mCertTrustPolicies = policies;
+  mDefaultTrustPolicy = QgsAuthCertUtils::NoPolicy;
+
+  // repartition cached CAs for the loaded policies
+  QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> >::const_iterator it = mCaCertsCache.constBegin();
+  for ( ; it != mCaCertsCache.constEnd(); ++it )
+  {
+    indexCaCert( QByteArray::fromHex( it.key().toAscii() ), it.value().second );
+  }
+  trustIndexChanged();
+
   QgsDebugMsg( "Rebuild of cert trust policy cache SUCCEEDED" );
   return true;
 }
 
 const QList<QSslCertificate> QgsAuthManager::getTrustedCaCerts( bool includeinvalid )
 {
+  // read before locking, since it may query the settings table
   QgsAuthCertUtils::CertTrustPolicy defaultpolicy( defaultCertTrustPolicy() );
-  QStringList trustedids = mCertTrustCache.value( QgsAuthCertUtils::Trusted );
-  QStringList untrustedids = mCertTrustCache.value( QgsAuthCertUtils::Untrusted );
-  const QList<QPair<QgsAuthCertUtils::CaCertSource, QSslCertificate> >& certpairs( mCaCertsCache.values() );
+  QMutexLocker locker( &mMutex );
+  return trustedCaCertsFromPartitions( defaultpolicy, includeinvalid );
+}
 
-  QList<QSslCertificate> trustedcerts;
-  for (int i = 0; i < certpairs.size(); ++i) {
-    QSslCertificate cert( certpairs.at( i ).second );
-    QString certid( QgsAuthCertUtils::shaHexForCert( cert ) );
-    if ( trustedids.contains( certid ) )
-    {
-      // trusted certs are always added regardless of their validity
-      trustedcerts.append( cert );
-    }
-    else if ( defaultpolicy == QgsAuthCertUtils::Trusted && !untrustedids.contains( certid ) )
-    {
-      if ( !includeinvalid && !cert.isValid() )
-        continue;
-      trustedcerts.append( cert );
-    }
+const QList<QSslCertificate> QgsAuthManager::trustedCaCertsFromPartitions( QgsAuthCertUtils::CertTrustPolicy defaultpolicy,
+    bool includeinvalid )
+{
+  // with mMutex held
+  recheckCaCertsValidity();
+  // trusted certs are always added regardless of their validity
+  QList<QSslCertificate> trustedcerts( mCaTrustPartitions[CaExplicitTrusted].values() );
+  if ( defaultpolicy == QgsAuthCertUtils::Trusted )
+  {
+    trustedcerts << mCaTrustPartitions[CaDefaultValid].values();
+    if ( includeinvalid )
+      trustedcerts << mCaTrustPartitions[CaDefaultInvalid].values();
   }
   return trustedcerts;
 }
 
 const QList<QSslCertificate> QgsAuthManager::getUntrustedCaCerts( QList<QSslCertificate> trustedCAs )
 {
+  QgsAuthCertUtils::CertTrustPolicy defaultpolicy( defaultCertTrustPolicy() );
+  QMutexLocker locker( &mMutex );
+  QList<QSslCertificate> untrustedCAs;
   if ( trustedCAs.isEmpty() )
   {
-    if ( mTrustedCaCertsCache.isEmpty() )
-    {
-      rebuildTrustedCaCertsCache();
-    }
-    trustedCAs = getTrustedCaCertsCache();
+    recheckCaCertsValidity();
+    // complement of getTrustedCaCerts(), straight from the partitions
+    untrustedCAs << mCaTrustPartitions[CaExplicitUntrusted].values();
+    untrustedCAs << mCaTrustPartitions[CaDefaultInvalid].values();
+    if ( defaultpolicy != QgsAuthCertUtils::Trusted )
+      untrustedCAs << mCaTrustPartitions[CaDefaultValid].values();
+    return untrustedCAs;
   }
 
-  const QList<QPair<QgsAuthCertUtils::CaCertSource, QSslCertificate> >& certpairs( mCaCertsCache.values() );
+  QSet<QString> trustedids;
+  Q_FOREACH ( const QSslCertificate& cert, trustedCAs )
+  {
+    trustedids << QgsAuthCertUtils::shaHexForCert( cert );
+  }
 
-  QList<QSslCertificate> untrustedCAs;
-  for (int i = 0; i < certpairs.size(); ++i) {
-    QSslCertificate cert( certpairs.at( i ).second );
-    if ( !trustedCAs.contains( cert ) )
+  QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> >::const_iterator it = mCaCertsCache.constBegin();
+  for ( ; it != mCaCertsCache.constEnd(); ++it )
+  {
+    if ( !trustedids.contains( it.key() ) )
     {
-      untrustedCAs.append( cert );
+      untrustedCAs.append( it.value().second );
     }
   }
   return untrustedCAs;
@@ -2073,12 +2951,39 @@ const QList<QSslCertificate> QgsAuthManager::getUntrustedCaCerts( QList<QSslCert
 
 bool QgsAuthManager::rebuildTrustedCaCertsCache()
 {
-  mTrustedCaCertsCache = getTrustedCaCerts();
+  // also invalidates SSL configs prebuilt by providers
+  bumpSslConfigGeneration();
+  getTrustedCaCertsCache();
   QgsDebugMsg( "Rebuilt trusted cert authorities cache" );
   // TODO: add some error trapping for the operation
   return true;
 }
 
+const QList<QSslCertificate> QgsAuthManager::getTrustedCaCertsCache()
+{
+  // hit on every network request: a snapshot copy, without mMutex or the trust index
+  int generation = sslConfigGeneration();
+  {
+    QReadLocker readlocker( &mTrustedCaCertsLock );
+    if ( mTrustedCaCertsGeneration == generation
+         && ( mTrustedCaCertsRecheck == 0 || QDateTime::currentMSecsSinceEpoch() < mTrustedCaCertsRecheck ) )
+      return mTrustedCaCertsCache;
+  }
+
+  QgsAuthCertUtils::CertTrustPolicy defaultpolicy( defaultCertTrustPolicy() );
+  QMutexLocker locker( &mMutex );
+  QList<QSslCertificate> cacerts( trustedCaCertsFromPartitions( defaultpolicy, false ) );
+  qint64 recheck = mCaValidityRecheck;
+  locker.unlock();
+
+  // tagged with the generation read first, so any change meanwhile rebuilds it on next use
+  QWriteLocker writelocker( &mTrustedCaCertsLock );
+  mTrustedCaCertsCache = cacerts;
+  mTrustedCaCertsGeneration = generation;
+  mTrustedCaCertsRecheck = recheck;
+  return cacerts;
+}
+
 const QByteArray QgsAuthManager::getTrustedCaCertsPemText( bool includeinvalid )
 {
   QByteArray capem;
@@ -2109,6 +3014,8 @@ void QgsAuthManager::clearAllCachedConfigs()
   {
     clearCachedConfig( configid );
   }
+  QMutexLocker locker( &mMutex );
+  mFailedConfigs.clear();
 }
 
 void QgsAuthManager::clearCachedConfig( const QString& authcfg )
@@ -2116,7 +3023,12 @@ void QgsAuthManager::clearCachedConfig( const QString& authcfg )
   if ( isDisabled() )
     return;
 
+  QMutexLocker locker( &mMutex );
+  mFailedConfigs.remove( authcfg );
   QgsAuthProvider* provider = configProvider( authcfg );
+  locker.unlock();
+
+  unwatchConfigFiles( authcfg );
   if ( provider )
   {
     provider->clearCachedConfig( authcfg );
@@ -2158,18 +3070,61 @@ QgsAuthManager::QgsAuthManager()
     , mProvidersRegistered( false )
     , mMasterPass( QString() )
     , mAuthDisabled( false )
+    , mMasterPassVerified( false )
+    , mMasterPassKeyHash( QString() )
+    , mCryptoContext( 0 )
+    , mPassTableGeneration( 0 )
+    , mMasterPassVerifiedGeneration( -1 )
+    , mPassRowCached( false )
+    , mPassRowCount( 0 )
+    , mPassTableQueries( 0 )
+    , mFailedConfigs( "failed configs", 1000 )
+    , mFailedConfigTtl( QSettings().value( "/qgis/auth/failed_config_ttl", 30 ).toInt() )
+    , mDbBusyRetries( QSettings().value( "/qgis/auth/db/busy_retries", 3 ).toInt() )
+    , mFileWatcher( 0 )
+    , mPrewarmTotal( 0 )
+    , mPrewarmDone( 0 )
+    , mPrewarmSucceeded( 0 )
+    , mMutex( QMutex::Recursive )
+    , mMasterPassMutex( QMutex::Recursive )
 {
   connect( this, SIGNAL( messageOut( const QString&, const QString&, QgsAuthManager::MessageLevel ) ),
            this, SLOT( writeToConsole( const QString&, const QString&, QgsAuthManager::MessageLevel ) ) );
+
+  mFileWatcher = new QFileSystemWatcher( this );
+  connect( mFileWatcher, SIGNAL( fileChanged( const QString& ) ),
+           this, SLOT( watchedFileChanged( const QString& ) ) );
+  connect( mFileWatcher, SIGNAL( directoryChanged( const QString& ) ),
+           this, SLOT( watchedDirectoryChanged( const QString& ) ) );
+
+  mRefreshPool.setMaxThreadCount( 2 );
+
+#ifndef QT_NO_OPENSSL
+  mIdentitiesLoaded = false;
+  mDefaultTrustPolicy = QgsAuthCertUtils::NoPolicy;
+  mTrustedCaCertsGeneration = -1;
+  mTrustedCaCertsRecheck = 0;
+  mCaValidityRecheck = 0;
+  mCaFileSettingsLoaded = false;
+  mCaFileAllowInvalid = false;
+#endif
 }
 
 QgsAuthManager::~QgsAuthManager()
 {
+  // refresh tasks use the providers; waited on with the instance already unpublished, see QgsSingleton::cleanup()
+  mRefreshPool.waitForDone();
   if ( !isDisabled() )
   {
-    authDbConnection().close();
     qDeleteAll( mProviders.values() );
   }
+  // closes this thread's connection; worker threads' go when they exit
+  mAuthDbs.setLocalData( 0 );
+  delete mCryptoContext;
+  mCryptoContext = 0;
+  // interned certs and trust collections hold QCA certificates, which must go before QCA is deinitialized
+  QgsAuthCertRegistry::instance()->clear();
+  QgsAuthCertUtils::clearTrustCollections();
   delete mQcaInitializer;
   mQcaInitializer = 0;
 }
@@ -2187,6 +3142,8 @@ bool QgsAuthManager::masterPasswordInput()
 
   if ( ok && !pass.isEmpty() && !masterPasswordSame( pass ) )
   {
+    QMutexLocker locker( &mMutex );
+    masterPasswordSessionReset();
     mMasterPass = pass;
     return true;
   }
@@ -2198,16 +3155,219 @@ bool QgsAuthManager::masterPasswordRowsInDb( int *rows ) const
   if ( isDisabled() )
     return false;
 
+  if ( !masterPasswordLoadRow() )
+    return false;
+
+  QMutexLocker locker( &mMutex );
+  *rows = mPassRowCount;
+  return true;
+}
+
+bool QgsAuthManager::masterPasswordLoadRow() const
+{
+  if ( isDisabled() )
+    return false;
+
+  QMutexLocker locker( &mMutex );
+  while ( !mPassRowCached )
+  {
+    int generation = mPassTableGeneration;
+    ++mPassTableQueries;
+    locker.unlock();
+
+    QSqlQuery query( authDbConnection() );
+    query.prepare( QString( "SELECT salt, civ, hash, dek FROM %1" ).arg( authDbPassTable() ) );
+
+    if ( !authDbQuery( &query ) )
+      return false;
+
+    // uses first found row; callers verify there is only one
+    int rows = 0;
+    QString salt, civ, hash, dek;
+    while ( query.next() )
+    {
+      if ( rows == 0 )
+      {
+        salt = query.value( 0 ).toString();
+        civ = query.value( 1 ).toString();
+        hash = query.value( 2 ).toString();
+        dek = query.value( 3 ).toString();
+      }
+      ++rows;
+    }
+
+    locker.relock();
+    // row was rewritten while querying, so query it again
+    if ( generation != mPassTableGeneration )
+      continue;
+
+    mPassSalt = salt;
+    mPassCiv = civ;
+    mPassHash = hash;
+    mPassDek = dek;
+    mPassRowCount = rows;
+    mPassRowCached = true;
+    QgsDebugMsg( QString( "Master password: cached auth_pass row (%1 rows)" ).arg( rows ) );
+  }
+  return true;
+}
+
+void QgsAuthManager::masterPasswordInvalidateRow()
+{
+  QMutexLocker locker( &mMutex );
+  mPassRowCached = false;
+  mPassRowCount = 0;
+  mPassSalt.clear();
+  mPassCiv.clear();
+  mPassHash.clear();
+  mPassDek.clear();
+  ++mPassTableGeneration;
+}
+
+bool QgsAuthManager::masterPasswordLoadDataKey()
+{
+  if ( !masterPasswordLoadRow() )
+    return false;
+
+  QMutexLocker locker( &mMutex );
+  if ( mPassRowCount < 1 )
+    return false;
+  QString pass( mMasterPass );
+  QString civ( mPassCiv );
+  QString wrappedkey( mPassDek );
+  locker.unlock();
+
+  if ( !wrappedkey.isEmpty() )
+  {
+    QCA::SecureArray datakey;
+    if ( !QgsAuthCrypto::unwrapDataKey( pass, wrappedkey, &datakey ) )
+      return false;
+
+    masterPasswordSetDataKey( datakey, civ );
+    return true;
+  }
+
+  // migrate database that predates envelope encryption: existing records are encrypted directly
+  // with the password bytes; re-encrypt them with a random data key, so the previous password
+  // can not decrypt them anymore once the master password is reset
+  QgsDebugMsg( "Master password: migrating to wrapped data key" );
+
+  QString dbbackup;
+  if ( !authDbBackup( QString( "dek" ), &dbbackup ) )
+  {
+    const char* err = QT_TR_NOOP( "Master password: data key migration FAILED, could not backup current database" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), CRITICAL );
+    return false;
+  }
+  QgsDebugMsg( QString( "Master password: backed up previous db at %1" ).arg( dbbackup ) );
+
+  QgsAuthCryptoContext passcontext( QCA::SecureArray( QByteArray( pass.toUtf8().constData() ) ), civ );
+  QCA::SecureArray datakey;
+  QgsAuthCrypto::generateDataKey( &datakey );
+  QgsAuthCryptoContext keycontext( datakey, civ );
+  QString dek( QgsAuthCrypto::wrapDataKey( pass, datakey ) );
+  if ( !passcontext.isValid() || !keycontext.isValid() || dek.isEmpty() )
+    return false;
+
+  // records and wrapped key are swapped together, or not at all
+  if ( !authDbStartTransaction() )
+    return false;
+
   QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT Count(*) FROM %1" ).arg( authDbPassTable() ) );
+  query.prepare( QString( "UPDATE %1 SET dek = :dek" ).arg( authDbPassTable() ) );
+  query.bindValue( ":dek", dek );
+
+  if ( !reencryptDataBlobs( &passcontext, &keycontext ) || !authDbQuery( &query ) )
+  {
+    authDbConnection().rollback();
+    const char* err = QT_TR_NOOP( "Master password: data key migration FAILED, changes rolled back" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), CRITICAL );
+    return false;
+  }
+
+  if ( !authDbCommit() )
+  {
+    authDbConnection().rollback();
+    const char* err = QT_TR_NOOP( "Master password: data key migration FAILED to commit, changes rolled back" );
+    QgsDebugMsg( err );
+    emit messageOut( tr( err ), authManTag(), CRITICAL );
+    return false;
+  }
+
+  masterPasswordInvalidateRow();
+  masterPasswordSetDataKey( datakey, civ );
+
+  QgsDebugMsg( "Master password: migrated to wrapped data key" );
+  return true;
+}
+
+bool QgsAuthManager::reencryptDataBlobs( QgsAuthCryptoContext *from, QgsAuthCryptoContext *to )
+{
+  // within a transaction; ciphertext is stored as BLOB, or hex text in not (yet) migrated rows
+
+  // table, id column, value column, condition selecting encrypted rows
+  struct CipherColumn
+  {
+    QString table;
+    const char *idcolumn;
+    const char *column;
+    const char *where;
+  };
+  const CipherColumn columns[] =
+  {
+    { authDbConfigTable(), "id", "config", "" },
+    { authDbIdentitiesTable(), "id", "key", "" },
+    { authDbSettingsTable(), "setting", "value", " WHERE encrypted = 1" }
+  };
 
-  bool ok = authDbQuery( &query );
-  if ( query.first() )
+  for ( unsigned int i = 0; i < sizeof( columns ) / sizeof( columns[0] ); ++i )
   {
-    *rows = query.value( 0 ).toInt();
+    const CipherColumn &col = columns[i];
+
+    // gather first, so rows are not updated under an active select
+    QList< QPair<QString, QVariant> > rows;
+    QSqlQuery query( authDbConnection() );
+    query.prepare( QString( "SELECT %1, %2 FROM %3%4" )
+                   .arg( col.idcolumn ).arg( col.column ).arg( col.table ).arg( col.where ) );
+    if ( !authDbQuery( &query ) )
+      return false;
+    while ( query.next() )
+    {
+      QVariant value( query.value( 1 ) );
+      bool hextext = value.type() == QVariant::String;
+      QByteArray ciphertext( hextext ? QByteArray::fromHex( value.toString().toAscii() ) : value.toByteArray() );
+
+      QCA::SecureArray data;
+      if ( !from->decrypt( ciphertext, &data ) )
+      {
+        QgsDebugMsg( QString( "Re-encrypt FAILED: could not decrypt %1 for id: %2" )
+                     .arg( col.table ).arg( query.value( 0 ).toString() ) );
+        return false;
+      }
+
+      QByteArray encrypted;
+      if ( !to->encrypt( data, &encrypted ) )
+        return false;
+      rows << qMakePair( query.value( 0 ).toString(),
+                         hextext ? QVariant( QString( encrypted.toHex() ) ) : QVariant( encrypted ) );
+    }
+    query.clear();
+
+    query.prepare( QString( "UPDATE %1 SET %2 = :value WHERE %3 = :id" )
+                   .arg( col.table ).arg( col.column ).arg( col.idcolumn ) );
+    for ( int j = 0; j < rows.size(); ++j )
+    {
+      query.bindValue( ":value", rows.at( j ).second );
+      query.bindValue( ":id", rows.at( j ).first );
+      if ( !authDbQuery( &query ) )
+        return false;
+    }
+    QgsDebugMsg( QString( "Re-encrypted %1 %2 values in %3" ).arg( rows.size() ).arg( col.column ).arg( col.table ) );
   }
 
-  return ok;
+  return true;
 }
 
 bool QgsAuthManager::masterPasswordHashInDb() const
@@ -2227,51 +3387,89 @@ bool QgsAuthManager::masterPasswordHashInDb() const
   return ( rows == 1 );
 }
 
-bool QgsAuthManager::masterPasswordCheckAgainstDb() const
+bool QgsAuthManager::masterPasswordCheckAgainstDb( QString *hashderived ) const
 {
   if ( isDisabled() )
     return false;
 
   // first verify there is only one row in auth db (uses first found)
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT salt, hash FROM %1" ).arg( authDbPassTable() ) );
-  if ( !authDbQuery( &query ) )
+  if ( !masterPasswordLoadRow() )
     return false;
 
-  if ( !query.first() )
+  QMutexLocker locker( &mMutex );
+  if ( mPassRowCount < 1 )
     return false;
+  QString pass( mMasterPass );
+  QString salt( mPassSalt );
+  QString hash( mPassHash );
+  locker.unlock();
 
-  QString salt = query.value( 0 ).toString();
-  QString hash = query.value( 1 ).toString();
-
-  return QgsAuthCrypto::verifyPasswordKeyHash( mMasterPass, salt, hash );
+  // key derivation is slow by design, so not with mMutex held
+  return QgsAuthCrypto::verifyPasswordKeyHash( pass, salt, hash, hashderived );
 }
 
-bool QgsAuthManager::masterPasswordStoreInDb() const
+bool QgsAuthManager::masterPasswordStoreInDb()
 {
   if ( isDisabled() )
     return false;
 
+  QMutexLocker locker( &mMutex );
+  QString pass( mMasterPass );
+  locker.unlock();
+
   QString salt, hash, civ;
-  QgsAuthCrypto::passwordKeyHash( mMasterPass, &salt, &hash, &civ );
+  QgsAuthCrypto::passwordKeyHash( pass, &salt, &hash, &civ );
+
+  QCA::SecureArray datakey;
+  QgsAuthCrypto::generateDataKey( &datakey );
+  QString dek( QgsAuthCrypto::wrapDataKey( pass, datakey ) );
+  if ( dek.isEmpty() )
+    return false;
+
+  return masterPasswordWriteRow( salt, civ, hash, dek, false );
+}
+
+bool QgsAuthManager::masterPasswordWriteRow( const QString& salt, const QString& civ,
+    const QString& hash, const QString& dek, bool replace )
+{
+  if ( isDisabled() )
+    return false;
+
+  if ( !authDbStartTransaction() )
+    return false;
 
   QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "INSERT INTO %1 (salt, hash, civ) VALUES (:salt, :hash, :civ)" ).arg( authDbPassTable() ) );
+  if ( replace )
+  {
+    query.prepare( QString( "DELETE FROM %1" ).arg( authDbPassTable() ) );
+    if ( !authDbQuery( &query ) )
+    {
+      authDbConnection().rollback();
+      return false;
+    }
+    query.clear();
+  }
+
+  query.prepare( QString( "INSERT INTO %1 (salt, hash, civ, dek) "
+                          "VALUES (:salt, :hash, :civ, :dek)" ).arg( authDbPassTable() ) );
 
   query.bindValue( ":salt", salt );
   query.bindValue( ":hash", hash );
   query.bindValue( ":civ", civ );
-
-  if ( !authDbStartTransaction() )
-    return false;
+  query.bindValue( ":dek", dek );
 
   if ( !authDbQuery( &query ) )
+  {
+    authDbConnection().rollback();
     return false;
+  }
 
   if ( !authDbCommit() )
     return false;
 
+  masterPasswordInvalidateRow();
+
   return true;
 }
 
@@ -2284,24 +3482,95 @@ bool QgsAuthManager::masterPasswordClearDb()
   query.prepare( QString( "DELETE FROM %1" ).arg( authDbPassTable() ) );
   bool res = authDbTransactionQuery( &query );
   if ( res )
+  {
+    masterPasswordInvalidateRow();
     clearMasterPassword();
+  }
   return res;
 }
 
+void QgsAuthManager::masterPasswordSessionReset()
+{
+  QMutexLocker locker( &mMutex );
+  mMasterPassVerified = false;
+  mMasterPassKeyHash.clear();
+  mDataKey.clear();
+  delete mCryptoContext;
+  mCryptoContext = 0;
+#ifndef QT_NO_OPENSSL
+  mIdentityKeyGeneration.ref();
+#endif
+}
+
+void QgsAuthManager::masterPasswordSetDataKey( const QCA::SecureArray& datakey, const QString& civ )
+{
+  QMutexLocker locker( &mMutex );
+  mDataKey = datakey;
+  delete mCryptoContext;
+  mCryptoContext = new QgsAuthCryptoContext( mDataKey, civ );
+}
+
+const QString QgsAuthManager::encryptData( const QString& text ) const
+{
+  // hex text, for values stored in TEXT columns, e.g. settings
+  QByteArray encrypted( encryptDataBlob( text ) );
+  if ( encrypted.isEmpty() )
+    return QString();
+  return QString( encrypted.toHex() );
+}
+
+const QString QgsAuthManager::decryptData( const QString& text ) const
+{
+  QMutexLocker locker( &mMutex );
+  QCA::SecureArray decrypted;
+  if ( !mCryptoContext || !mCryptoContext->decrypt( QByteArray::fromHex( text.toAscii() ), &decrypted ) )
+  {
+    QgsDebugMsg( "Decrypt data FAILED: no data encryption key context" );
+    return QString();
+  }
+  return QString::fromUtf8( decrypted.constData(), decrypted.size() );
+}
+
+const QByteArray QgsAuthManager::encryptDataBlob( const QString& text ) const
+{
+  QMutexLocker locker( &mMutex );
+  QByteArray encrypted;
+  if ( !mCryptoContext || !mCryptoContext->encrypt( QCA::SecureArray( text.toUtf8() ), &encrypted ) )
+  {
+    QgsDebugMsg( "Encrypt data FAILED: no data encryption key context" );
+    return QByteArray();
+  }
+  return encrypted;
+}
+
+const QString QgsAuthManager::decryptDataBlob( const QVariant& value ) const
+{
+  QMutexLocker locker( &mMutex );
+  // tolerate hex text, for rows not (yet) migrated to BLOB storage
+  if ( value.type() == QVariant::String )
+    return decryptData( value.toString() );
+
+  QCA::SecureArray decrypted;
+  if ( !mCryptoContext || !mCryptoContext->decrypt( value.toByteArray(), &decrypted ) )
+  {
+    QgsDebugMsg( "Decrypt data FAILED: no data encryption key context" );
+    return QString();
+  }
+  return QString::fromUtf8( decrypted.constData(), decrypted.size() );
+}
+
 const QString QgsAuthManager::masterPasswordCiv() const
 {
   if ( isDisabled() )
     return QString();
 
-  QSqlQuery query( authDbConnection() );
-  query.prepare( QString( "SELECT civ FROM %1" ).arg( authDbPassTable() ) );
-  if ( !authDbQuery( &query ) )
+  if ( !masterPasswordLoadRow() )
     return QString();
 
-  if ( !query.first() )
+  QMutexLocker locker( &mMutex );
+  if ( mPassRowCount < 1 )
     return QString();
-
-  return query.value( 0 ).toString();
+  return mPassCiv;
 }
 
 QStringList QgsAuthManager::configIds() const
@@ -2353,7 +3622,7 @@ bool QgsAuthManager::verifyPasswordCanDecryptConfigs() const
   while ( query.next() )
   {
     ++checked;
-    QString configstring( QgsAuthCrypto::decrypt( mMasterPass, masterPasswordCiv(), query.value( 1 ).toString() ) );
+    QString configstring( decryptDataBlob( query.value( 1 ) ) );
     if ( configstring.isEmpty() )
     {
       QgsDebugMsg( QString( "Verify password can decrypt configs FAILED, could not decrypt a config (id: %1)" )
@@ -2366,80 +3635,113 @@ bool QgsAuthManager::verifyPasswordCanDecryptConfigs() const
   return true;
 }
 
-bool QgsAuthManager::reencryptAllAuthenticationConfigs( const QString &prevpass, const QString &prevciv )
+bool QgsAuthManager::authDbBackup( const QString& tag, QString *backuppath ) const
 {
-  if ( isDisabled() )
+  if ( !authDbOpen() )
     return false;
 
-  bool res = true;
-  foreach ( QString configid, configIds() )
-  {
-    res = res && reencryptAuthenticationConfig( configid, prevpass, prevciv );
-  }
-  return res;
-}
+  // 'qgis-auth_YYYY-MM-DD-HHMMSS[_tag].db'
+  QString datestamp( QDateTime::currentDateTime().toString( "yyyy-MM-dd-hhmmss" ) );
+  if ( !tag.isEmpty() )
+    datestamp += QString( "_%1" ).arg( tag );
+  QString dbbackup( authenticationDbPath() );
+  dbbackup.replace( QString( ".db" ), QString( "_%1.db" ).arg( datestamp ) );
 
-bool QgsAuthManager::reencryptAuthenticationConfig( const QString &authcfg, const QString &prevpass, const QString &prevciv )
-{
-  if ( isDisabled() )
+  // copy through the open connection, inside one transaction, so the backup is a consistent
+  // snapshot that includes changes still pending in the journal
+  if ( QFile::exists( dbbackup ) && !QFile::remove( dbbackup ) )
+  {
+    QgsDebugMsg( QString( "Auth db backup FAILED: could not replace %1" ).arg( dbbackup ) );
     return false;
-
-  // no need to check for setMasterPassword, since this is private and it will be set
+  }
 
   QSqlQuery query( authDbConnection() );
-
-  query.prepare( QString( "SELECT config FROM %1 "
-                          "WHERE id = :id" ).arg( authDbConfigTable() ) );
-
-  query.bindValue( ":id", authcfg );
-
+  query.prepare( "ATTACH DATABASE :path AS backup" );
+  query.bindValue( ":path", dbbackup );
   if ( !authDbQuery( &query ) )
-    return false;
-
-  if ( !query.isActive() || !query.isSelect() )
   {
-    QgsDebugMsg( QString( "Reencrypt FAILED, query not active or a select operation for authcfg: %2" ).arg( authcfg ) );
+    QgsDebugMsg( QString( "Auth db backup FAILED: could not create %1" ).arg( dbbackup ) );
+    QFile::remove( dbbackup );
     return false;
   }
 
-  if ( query.first() )
+  bool ok = authDbStartTransaction();
+  if ( ok )
   {
-    QString configstring( QgsAuthCrypto::decrypt( prevpass, prevciv, query.value( 0 ).toString() ) );
-
-    query.clear();
+    ok = authDbBackupSchema();
+    if ( ok )
+      ok = authDbCommit(); // rolls back on failure
+    else
+      authDbConnection().rollback();
+  }
 
-    query.prepare( QString( "UPDATE %1 "
-                            "SET config = :config "
-                            "WHERE id = :id" ).arg( authDbConfigTable() ) );
+  query.prepare( "DETACH DATABASE backup" );
+  if ( !authDbQuery( &query ) )
+    ok = false;
 
-    query.bindValue( ":id", authcfg );
-    query.bindValue( ":config", QgsAuthCrypto::encrypt( mMasterPass, masterPasswordCiv(), configstring ) );
+  if ( !ok )
+  {
+    QgsDebugMsg( QString( "Auth db backup FAILED: %1" ).arg( dbbackup ) );
+    QFile::remove( dbbackup );
+    return false;
+  }
 
-    if ( !authDbStartTransaction() )
-      return false;
+  if ( backuppath )
+    *backuppath = dbbackup;
+  return true;
+}
 
-    if ( !authDbQuery( &query ) )
-      return false;
+bool QgsAuthManager::authDbBackupSchema() const
+{
+  // within a transaction, with the backup db attached as 'backup'
+  QSqlQuery query( authDbConnection() );
+  query.prepare( "SELECT type, name, sql FROM main.sqlite_master "
+                 "WHERE sql NOT NULL AND name NOT LIKE 'sqlite_%' "
+                 "ORDER BY CASE type WHEN 'table' THEN 0 ELSE 1 END" );
+  if ( !authDbQuery( &query ) )
+    return false;
 
-    if ( !authDbCommit() )
+  QStringList tables;
+  QStringList statements;
+  // schema name qualifies the created object, e.g. CREATE UNIQUE INDEX backup.'id_index' on ...
+  QRegExp createrx( "^(\\s*CREATE\\s+(?:UNIQUE\\s+)?(?:TABLE|INDEX|VIEW|TRIGGER)\\s+(?:IF\\s+NOT\\s+EXISTS\\s+)?)",
+                    Qt::CaseInsensitive );
+  while ( query.next() )
+  {
+    QString sql( query.value( 2 ).toString() );
+    if ( createrx.indexIn( sql ) < 0 )
+    {
+      QgsDebugMsg( QString( "Auth db backup FAILED: unexpected schema statement: %1" ).arg( sql ) );
       return false;
-
-    QgsDebugMsg( QString( "Reencrypt SUCCESS for authcfg: %2" ).arg( authcfg ) );
-    return true;
+    }
+    statements << sql.insert( createrx.matchedLength(), "backup." );
+    if ( query.value( 0 ).toString() == "table" )
+      tables << query.value( 1 ).toString();
   }
-  else
+  query.clear();
+
+  Q_FOREACH( const QString& statement, statements )
   {
-    QgsDebugMsg( QString( "Reencrypt FAILED, could not find in db authcfg: %2" ).arg( authcfg ) );
-    return false;
+    query.prepare( statement );
+    if ( !authDbQuery( &query ) )
+      return false;
   }
 
-  if ( query.next() )
+  Q_FOREACH( const QString& table, tables )
   {
-    QgsDebugMsg( QString( "Select contains more than one for authcfg: %1" ).arg( authcfg ) );
-    emit messageOut( tr( "Authentication database contains duplicate configuration IDs" ), authManTag(), WARNING );
+    QString name( table );
+    name.replace( "\"", "\"\"" );
+    query.prepare( QString( "INSERT INTO backup.\"%1\" SELECT * FROM main.\"%1\"" ).arg( name ) );
+    if ( !authDbQuery( &query ) )
+      return false;
   }
 
-  return false;
+  // schema version is not part of sqlite_master
+  int version = authDbSchemaVersion();
+  if ( version < 0 )
+    return false;
+  query.prepare( QString( "PRAGMA backup.user_version = %1" ).arg( version ) );
+  return authDbQuery( &query );
 }
 
 bool QgsAuthManager::authDbOpen() const
@@ -2459,6 +3761,7 @@ bool QgsAuthManager::authDbOpen() const
       emit messageOut( tr( "Unable to establish authentication database connection" ), authManTag(), CRITICAL );
       return false;
     }
+    authDbSetPragmas( authdb );
   }
   return true;
 }
@@ -2469,27 +3772,79 @@ bool QgsAuthManager::authDbQuery( QSqlQuery *query ) const
     return false;
 
   query->setForwardOnly( true );
-  query->exec();
+
+  int attempt = 0;
+  while ( !query->exec() && authDbRetryBusy( query->lastError(), attempt++ ) )
+    ;
 
   if ( query->lastError().isValid() )
   {
     QgsDebugMsg( QString( "Auth db query FAILED: %1\nError: %2" )
                  .arg( query->executedQuery() )
                  .arg( query->lastError().text() ) );
-    emit messageOut( tr( "Auth db query FAILED" ), authManTag(), WARNING );
+    if ( authDbIsBusyError( query->lastError() ) )
+      emit messageOut( tr( "Auth db query FAILED: database is locked by another process" ), authManTag(), WARNING );
+    else
+      emit messageOut( tr( "Auth db query FAILED" ), authManTag(), WARNING );
     return false;
   }
 
   return true;
 }
 
+bool QgsAuthManager::authDbIsBusyError( const QSqlError& error )
+{
+  if ( !error.isValid() )
+    return false;
+
+  // native QSQLITE error number is the SQLite result code for statements:
+  // SQLITE_BUSY (5) or SQLITE_LOCKED (6), stripped of extended result code
+  if ( error.number() > 0 )
+  {
+    int code = error.number() & 0xff;
+    return code == 5 || code == 6;
+  }
+
+  // Qt4 driver reports transaction (BEGIN/COMMIT) errors as -1, with SQLite's message
+  QString text( error.databaseText() );
+  return text.contains( "database is locked", Qt::CaseInsensitive )
+         || text.contains( "table is locked", Qt::CaseInsensitive )
+         || text.contains( "schema is locked", Qt::CaseInsensitive );
+}
+
+bool QgsAuthManager::authDbRetryBusy( const QSqlError& error, int attempt ) const
+{
+  if ( !authDbIsBusyError( error ) )
+    return false;
+
+  // busy_timeout already waited inside SQLite; this covers cases where its handler
+  // is not invoked, e.g. lock upgrade conflicts or a commit blocked by readers
+  int maxretries = mDbBusyRetries;
+  if ( attempt >= maxretries )
+    return false;
+
+  // do not block the GUI any longer than the busy handler did
+  if ( QCoreApplication::instance() && QThread::currentThread() == QCoreApplication::instance()->thread() )
+    return false;
+
+  unsigned long delay = 50UL << attempt; // 50, 100, 200 ms...
+  QgsDebugMsg( QString( "Auth db busy, retrying in %1 ms (attempt %2 of %3)" )
+               .arg( delay ).arg( attempt + 1 ).arg( maxretries ) );
+  QgsAuthSleeper::msleep( delay );
+  return true;
+}
+
 bool QgsAuthManager::authDbStartTransaction() const
 {
   if ( isDisabled() )
     return false;
 
-  if ( !authDbConnection().transaction() )
+  int attempt = 0;
+  while ( !authDbConnection().transaction() )
   {
+    if ( authDbRetryBusy( authDbConnection().lastError(), attempt++ ) )
+      continue;
+
     const char* err = QT_TR_NOOP( "Auth db FAILED to start transaction" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
@@ -2504,8 +3859,12 @@ bool QgsAuthManager::authDbCommit() const
   if ( isDisabled() )
     return false;
 
-  if ( !authDbConnection().commit() )
+  int attempt = 0;
+  while ( !authDbConnection().commit() )
   {
+    if ( authDbRetryBusy( authDbConnection().lastError(), attempt++ ) )
+      continue;
+
     const char* err = QT_TR_NOOP( "Auth db FAILED to rollback changes" );
     QgsDebugMsg( err );
     emit messageOut( tr( err ), authManTag(), WARNING );
@@ -2521,34 +3880,153 @@ bool QgsAuthManager::authDbTransactionQuery( QSqlQuery *query ) const
   if ( isDisabled() )
     return false;
 
-  if ( !authDbConnection().transaction() )
-  {
-    const char* err = QT_TR_NOOP( "Auth db FAILED to start transaction" );
-    QgsDebugMsg( err );
-    emit messageOut( tr( err ), authManTag(), WARNING );
+  if ( !authDbStartTransaction() )
     return false;
-  }
 
-  bool ok = authDbQuery( query );
-
-  if ( ok && !authDbConnection().commit() )
+  if ( !authDbQuery( query ) )
   {
-    const char* err = QT_TR_NOOP( "Auth db FAILED to rollback changes" );
-    QgsDebugMsg( err );
-    emit messageOut( tr( err ), authManTag(), WARNING );
     authDbConnection().rollback();
     return false;
   }
 
-  return ok;
+  return authDbCommit();
 }
 
+#ifndef QT_NO_OPENSSL
+QSslCertificate QgsAuthManager::certFromDbValue( const QVariant& value )
+{
+  // tolerate PEM text, for rows not (yet) migrated to BLOB storage
+  if ( value.type() == QVariant::String )
+    return QSslCertificate( value.toString().toAscii(), QSsl::Pem );
+  return QSslCertificate( value.toByteArray(), QSsl::Der );
+}
+#endif
+
 void QgsAuthManager::insertCaCertInCache( QgsAuthCertUtils::CaCertSource source, const QList<QSslCertificate>& certs )
 {
+  QMutexLocker locker( &mMutex );
   Q_FOREACH( const QSslCertificate& cert, certs )
   {
-    mCaCertsCache.insert( QgsAuthCertUtils::shaHexForCert( cert ),
-                             QPair<QgsAuthCertUtils::CaCertSource, QSslCertificate>( source, cert ) );
+    QgsAuthCertHandle entry( QgsAuthCertRegistry::instance()->intern( cert ) );
+    if ( !entry )
+      continue;
+    const QByteArray& digest( entry->digest() );
+    const QString& id( entry->shaHex() );
+    QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> >::iterator it = mCaCertsCache.find( id );
+    if ( it != mCaCertsCache.end() && it.value().first != source )
+    {
+      mShadowedCaCerts.insert( id, it.value() );
+    }
+    mCaCertsCache.insert( id, QPair<QgsAuthCertUtils::CaCertSource, QSslCertificate>( source, cert ) );
+    indexCaCert( digest, cert );
+  }
+  if ( !certs.isEmpty() )
+    trustIndexChanged();
+}
+
+void QgsAuthManager::removeCaCertFromCache( const QString& id )
+{
+  QMutexLocker locker( &mMutex );
+  QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> >::iterator it = mCaCertsCache.find( id );
+  // only database CAs are removable; system and file CAs go with a cache rebuild
+  if ( it == mCaCertsCache.end() || it.value().first != QgsAuthCertUtils::InDatabase )
+    return;
+
+  QByteArray digest( QByteArray::fromHex( id.toAscii() ) );
+  if ( mShadowedCaCerts.contains( id ) )
+  {
+    it.value() = mShadowedCaCerts.take( id );
+    indexCaCert( digest, it.value().second );
   }
+  else
+  {
+    mCaCertsCache.erase( it );
+    unindexCaCert( digest );
+  }
+  trustIndexChanged();
+}
+
+void QgsAuthManager::indexCaCert( const QByteArray& digest, const QSslCertificate& cert )
+{
+  unindexCaCert( digest );
+
+  CaTrustPartition partition;
+  switch ( mCertTrustPolicies.value( digest, QgsAuthCertUtils::DefaultTrust ) )
+  {
+    case QgsAuthCertUtils::Trusted:
+      partition = CaExplicitTrusted;
+      break;
+    case QgsAuthCertUtils::Untrusted:
+      partition = CaExplicitUntrusted;
+      break;
+    default:
+    {
+      bool valid = QgsAuthCertRegistry::instance()->intern( cert )->isValid();
+      partition = valid ? CaDefaultValid : CaDefaultInvalid;
+      // validity changes at expiry, or once a not yet valid cert becomes effective
+      QDateTime change( valid ? cert.expiryDate() : cert.effectiveDate() );
+      if ( change.isValid() && change > QDateTime::currentDateTime() )
+      {
+        qint64 changems = change.toMSecsSinceEpoch();
+        if ( mCaValidityRecheck == 0 || changems < mCaValidityRecheck )
+          mCaValidityRecheck = changems;
+      }
+      break;
+    }
+  }
+  mCaTrustPartitions[partition].insert( digest, cert );
+}
+
+void QgsAuthManager::recheckCaCertsValidity()
+{
+  // with mMutex held
+  if ( mCaValidityRecheck == 0 || QDateTime::currentMSecsSinceEpoch() < mCaValidityRecheck )
+    return;
+
+  QgsDebugMsg( "Re-splitting default trust CAs on validity" );
+  mCaValidityRecheck = 0;
+  QHash<QByteArray, QSslCertificate> defaultcerts( mCaTrustPartitions[CaDefaultValid] );
+  defaultcerts.unite( mCaTrustPartitions[CaDefaultInvalid] );
+  QHash<QByteArray, QSslCertificate>::const_iterator it = defaultcerts.constBegin();
+  for ( ; it != defaultcerts.constEnd(); ++it )
+  {
+    indexCaCert( it.key(), it.value() );
+  }
+  trustIndexChanged();
+}
+
+void QgsAuthManager::unindexCaCert( const QByteArray& digest )
+{
+  for ( int i = 0; i < CaPartitionCount; ++i )
+  {
+    if ( mCaTrustPartitions[i].remove( digest ) > 0 )
+      return;
+  }
+}
+
+void QgsAuthManager::updateCertTrustIndex( const QString& id, QgsAuthCertUtils::CertTrustPolicy policy )
+{
+  QMutexLocker locker( &mMutex );
+  QByteArray digest( QByteArray::fromHex( id.toAscii() ) );
+  if ( policy == QgsAuthCertUtils::DefaultTrust )
+  {
+    mCertTrustPolicies.remove( digest );
+  }
+  else
+  {
+    mCertTrustPolicies.insert( digest, policy );
+  }
+
+  QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> >::const_iterator it = mCaCertsCache.constFind( id );
+  if ( it != mCaCertsCache.constEnd() )
+  {
+    indexCaCert( digest, it.value().second );
+  }
+  trustIndexChanged();
+}
+
+void QgsAuthManager::trustIndexChanged()
+{
+  bumpSslConfigGeneration();
 }
 
@@ -17,29 +17,39 @@
 #ifndef QGSAUTHENTICATIONMANAGER_H
 #define QGSAUTHENTICATIONMANAGER_H
 
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
 #include <QObject>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QReadWriteLock>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QSet>
 #include <QStringList>
+#include <QThreadPool>
+#include <QThreadStorage>
+#include <QtCrypto>
 
 #ifndef QT_NO_OPENSSL
 #include <QSslCertificate>
 #include <QSslKey>
-#include <QtCrypto>
 #include "qgsauthenticationcertutils.h"
 #endif
 
 #include "qgsauthenticationconfig.h"
+#include "qgsauthenticationprovider.h"
 #include "qgssingleton.h"
 
 namespace QCA
 {
   class Initializer;
 }
-class QgsAuthProvider;
+class QFileSystemWatcher;
+class QgsAuthCryptoContext;
+class QgsAuthDb;
 
 /** \ingroup core
  * Singleton offering an interface to manage the authentication configuration database
@@ -105,18 +115,23 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     /** Verify a password hash existing in auth database */
     bool masterPasswordHashInDb() const;
 
-    /** Clear supplied master password
+    /** Number of SELECT queries issued against the password table (salt, civ, hash row)
+     * @note Useful for verifying the in-memory row cache is used on steady-state encrypt/decrypt
+     */
+    int masterPasswordQueryCount() const { return mPassTableQueries; }
+
+    /** Clear supplied master password and its verified session state
      * @note This will not necessarily clear authenticated connections cached in network connection managers
      */
-    void clearMasterPassword() { mMasterPass = QString(); }
+    void clearMasterPassword();
 
     /** Check whether supplied password is the same as the one already set
      * @param pass Password to verify
      */
     bool masterPasswordSame( const QString& pass ) const;
 
-    /** Reset the master password to a new one, then re-encrypt all previous
-     * configs in a new database file, optionally backup curren database
+    /** Reset the master password to a new one, by re-wrapping the data encryption key
+     * that all configs are encrypted with, optionally backup current database
      * @param newpass New master password to replace existing
      * @param oldpass Current master password to replace existing
      * @param keepbackup Whether to keep the genereated backup of current database
@@ -223,6 +238,32 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
      */
     bool updateNetworkReply( QNetworkReply *reply, const QString& authcfg );
 
+    /**
+     * Why updating a network request recently failed for a config
+     * @note Failures are remembered for /qgis/auth/failed_config_ttl seconds (default 30, 0 disables),
+     * or until the config, its referenced files or the master password change
+     * @param authcfg Associated authentication config id
+     * @return Empty string if the config has not recently failed
+     */
+    const QString authenticationFailureReason( const QString& authcfg );
+
+    /**
+     * Watch files a config references, so its cached credentials are rebuilt when they are rotated
+     * @note Called by providers once they cache a config; may be called from any thread.
+     * Watching stops when the config is cleared from cache, until it is cached again
+     * @see configFilesChanged
+     */
+    void watchConfigFiles( const QString& authcfg, const QStringList& files );
+
+    /**
+     * Build cached credentials of configs in the background, e.g. for a project's layers when it opens,
+     * so their first network requests find them ready
+     * @note Master password is verified (or prompted for) before returning. Progress is reported
+     * with prewarmProgress and prewarmFinished; per-config timings go to the debug log
+     * @param authcfgs Associated authentication config ids
+     */
+    void prewarmConfigs( const QStringList& authcfgs );
+
     ////////////////// Generic settings ///////////////////////
 
     /** Store an authentication setting (stored as string via QVariant( value ).toString() ) */
@@ -252,6 +293,9 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     /** Get certificate identities */
     const QList<QSslCertificate> getCertIdentities();
 
+    /** Get display names of certificate identities, as "name (organization)", keyed by id (sha hash) */
+    const QMap<QString, QString> getCertIdentityNames();
+
     /** Check if a certificate identity exists */
     bool existsCertIdentity( const QString& id );
 
@@ -296,7 +340,10 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     /** Get root system certificate authorities */
     const QList<QSslCertificate> getSystemRootCAs();
 
-    /** Get extra file-based certificate authorities */
+    /** Get extra file-based certificate authorities
+     * @note Filtered certs are cached by file path, size, modification time and allow invalid setting,
+     * in memory and (unless /qgis/auth/cafile_db_cache is false) in the auth database
+     */
     const QList<QSslCertificate> getExtraFileCAs();
 
     /** Get database-stored certificate authorities */
@@ -308,6 +355,7 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     /** Get all CA certs mapped to their sha1 from cache */
     const QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> > getCaCertsCache()
     {
+      QMutexLocker locker( &mMutex );
       return mCaCertsCache;
     }
 
@@ -338,7 +386,7 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     QgsAuthCertUtils::CertTrustPolicy defaultCertTrustPolicy();
 
     /** Get cache of certificate sha1s, per trust policy */
-    const QMap<QgsAuthCertUtils::CertTrustPolicy, QStringList > getCertTrustCache() { return mCertTrustCache; }
+    const QMap<QgsAuthCertUtils::CertTrustPolicy, QStringList > getCertTrustCache();
 
     /** Rebuild certificate authority cache */
     bool rebuildCertTrustCache();
@@ -352,12 +400,20 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     /** Rebuild trusted certificate authorities cache */
     bool rebuildTrustedCaCertsCache();
 
-    /** Get cache of trusted certificate authorities, ready for network connections */
-    const QList<QSslCertificate> getTrustedCaCertsCache() { return mTrustedCaCertsCache; }
+    /** Get cache of trusted certificate authorities, ready for network connections
+     * @note Snapshot per sslConfigGeneration(), read without locking the manager; rebuilt on demand
+     * after trust policies or certificate authorities change
+     */
+    const QList<QSslCertificate> getTrustedCaCertsCache();
 
     /** Get concatenated string of all trusted CA certificates */
     const QByteArray getTrustedCaCertsPemText( bool includeinvalid = false );
 
+    /** Generation of trusted CAs, identities and SSL server configs, bumped when any changes
+     * @note Used by providers to invalidate prebuilt SSL configurations
+     */
+    int sslConfigGeneration() const { return mSslConfigGeneration; }
+
 #endif
 
   signals:
@@ -376,6 +432,26 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
      */
     void masterPasswordVerified( bool verified ) const;
 
+    /**
+     * Emitted when files referenced by cached configs changed on disk, after their cached
+     * credentials were dropped (and before they are rebuilt in the background)
+     * @note Network code should drop pooled connections that used these configs
+     * @param authcfgs Associated authentication config ids
+     */
+    void configFilesChanged( const QStringList& authcfgs ) const;
+
+    /**
+     * Emitted as each config of prewarmConfigs is built
+     * @param authcfg Associated authentication config id
+     * @param ok Whether it could be built
+     * @param done Configs built so far, of total
+     * @param total Configs requested, including those of overlapping calls
+     */
+    void prewarmProgress( const QString& authcfg, bool ok, int done, int total ) const;
+
+    /** Emitted once all configs requested through prewarmConfigs are built */
+    void prewarmFinished( int succeeded, int total ) const;
+
   public slots:
     /** Clear all authentication configs from provider caches */
     void clearAllCachedConfigs();
@@ -386,6 +462,16 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
   private slots:
     void writeToConsole( const QString& message, const QString& tag = QString(), QgsAuthManager::MessageLevel level = INFO );
 
+    void addWatchedFiles( const QStringList& files );
+
+    void removeWatchedFiles( const QStringList& files );
+
+    void watchedFileChanged( const QString& path );
+
+    void watchedDirectoryChanged( const QString& path );
+
+    void prewarmConfigDone( const QString& authcfg, bool ok, int msecs );
+
   protected:
     explicit QgsAuthManager();
     ~QgsAuthManager();
@@ -398,36 +484,118 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
 
     bool createCertTables();
 
+    bool updatePassTable();
+
+    bool updateSettingsTable();
+
+    int authDbSchemaVersion() const;
+
+    bool setAuthDbSchemaVersion( int version );
+
+    bool updateAuthDbSchema();
+
+    bool migrateSchemaToV1();
+
     bool masterPasswordInput();
 
+    bool masterPasswordSessionVerified() const;
+
     bool masterPasswordRowsInDb( int *rows ) const;
 
-    bool masterPasswordCheckAgainstDb() const;
+    bool masterPasswordLoadRow() const;
+
+    void masterPasswordInvalidateRow();
+
+    bool masterPasswordCheckAgainstDb( QString *hashderived = 0 ) const;
 
-    bool masterPasswordStoreInDb() const;
+    bool masterPasswordStoreInDb();
+
+    bool masterPasswordWriteRow( const QString& salt, const QString& civ,
+                                 const QString& hash, const QString& dek, bool replace );
+
+    bool masterPasswordLoadDataKey();
+
+    bool reencryptDataBlobs( QgsAuthCryptoContext *from, QgsAuthCryptoContext *to );
+
+    void masterPasswordSetDataKey( const QCA::SecureArray& datakey, const QString& civ );
+
+    void masterPasswordSessionReset();
 
     bool masterPasswordClearDb();
 
     const QString masterPasswordCiv() const;
 
-    bool verifyPasswordCanDecryptConfigs() const;
+    const QString encryptData( const QString& text ) const;
+
+    const QString decryptData( const QString& text ) const;
 
-    bool reencryptAllAuthenticationConfigs( const QString& prevpass, const QString& prevciv );
+    const QByteArray encryptDataBlob( const QString& text ) const;
 
-    bool reencryptAuthenticationConfig( const QString& authcfg, const QString& prevpass, const QString& prevciv );
+    const QString decryptDataBlob( const QVariant& value ) const;
+
+    bool verifyPasswordCanDecryptConfigs() const;
 
     bool authDbOpen() const;
 
+    bool authDbBackup( const QString& tag, QString *backuppath ) const;
+
+    bool authDbBackupSchema() const;
+
+    void authDbSetPragmas( QSqlDatabase &authdb ) const;
+
+    QSqlQuery *authDbStatement( const QString& sql ) const;
+
     bool authDbQuery( QSqlQuery *query ) const;
 
+    static bool authDbIsBusyError( const QSqlError& error );
+
+    bool authDbRetryBusy( const QSqlError& error, int attempt ) const;
+
     bool authDbStartTransaction() const;
 
     bool authDbCommit() const;
 
     bool authDbTransactionQuery( QSqlQuery *query ) const;
 
+    bool cachedFailure( const QString& authcfg, QgsAuthFailure *failure );
+
+    void cacheFailure( const QString& authcfg, const QgsAuthFailure& failure );
+
+    void unwatchConfigFiles( const QString& authcfg );
+
+    void refreshChangedFiles( const QStringList& paths );
+
 #ifndef QT_NO_OPENSSL
+    static QSslCertificate certFromDbValue( const QVariant& value );
+
     void insertCaCertInCache( QgsAuthCertUtils::CaCertSource source, const QList<QSslCertificate> &certs );
+
+    void removeCaCertFromCache( const QString& id );
+
+    void indexCaCert( const QByteArray& digest, const QSslCertificate& cert );
+
+    void unindexCaCert( const QByteArray& digest );
+
+    void recheckCaCertsValidity();
+
+    const QList<QSslCertificate> trustedCaCertsFromPartitions( QgsAuthCertUtils::CertTrustPolicy defaultpolicy,
+        bool includeinvalid );
+
+    void updateCertTrustIndex( const QString& id, QgsAuthCertUtils::CertTrustPolicy policy );
+
+    void trustIndexChanged();
+
+    void clearExtraFileCAs();
+
+    bool loadExtraFileCAs( const QString& cachekey, QList<QSslCertificate> *certs );
+
+    bool storeExtraFileCAs( const QString& cachekey, const QList<QSslCertificate>& certs );
+
+    void bumpSslConfigGeneration() { mSslConfigGeneration.ref(); }
+
+    bool loadCertIdentities();
+
+    void clearCertIdentities();
 #endif
 
     const QString authDbPassTable() const { return smAuthPassTable; }
@@ -440,6 +608,8 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
 
     const QString authDbTrustTable() const { return smAuthTrustTable; }
 
+    const QString authDbCaFileCacheTable() const { return smAuthCaFileCacheTable; }
+
     static QgsAuthManager* smInstance;
     static const QString smAuthConfigTable;
     static const QString smAuthPassTable;
@@ -448,7 +618,9 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     static const QString smAuthServersTable;
     static const QString smAuthAuthoritiesTable;
     static const QString smAuthTrustTable;
+    static const QString smAuthCaFileCacheTable;
     static const QString smAuthManTag;
+    static const int smAuthDbSchemaVersion;
 
     QString mAuthDbPath;
 
@@ -461,14 +633,114 @@ class CORE_EXPORT QgsAuthManager : public QObject, public QgsSingleton<QgsAuthMa
     QString mMasterPass;
     bool mAuthDisabled;
 
+    // verified session state, so the password key hash is not re-derived on every call
+    bool mMasterPassVerified;
+    QString mMasterPassKeyHash;
+    // data encryption key, unwrapped with master password
+    QCA::SecureArray mDataKey;
+    QgsAuthCryptoContext *mCryptoContext;
+    // generation marker of auth_pass table, bumped whenever its row changes
+    int mPassTableGeneration;
+    int mMasterPassVerifiedGeneration;
+
+    // in-memory copy of the single auth_pass row
+    mutable bool mPassRowCached;
+    mutable int mPassRowCount;
+    mutable QString mPassSalt;
+    mutable QString mPassCiv;
+    mutable QString mPassHash;
+    mutable QString mPassDek;
+    mutable int mPassTableQueries;
+
+    // data access: connection and prepared statements of hot lookups, per thread
+    mutable QThreadStorage<QgsAuthDb*> mAuthDbs;
+
+    // negative cache of configs whose network request update failed, so repeated requests
+    // (e.g. map tiles) do not each re-query, decrypt and read files for a broken config
+    QgsAuthCache<QgsAuthFailure> mFailedConfigs;
+    int mFailedConfigTtl;
+
+    // retries of a busy auth db operation, after SQLite's busy timeout (off the GUI thread)
+    int mDbBusyRetries;
+
+    // files referenced by cached configs: path to authcfgs using it, and its last seen state;
+    // the watcher itself is only touched from the manager's thread
+    QFileSystemWatcher *mFileWatcher;
+    QHash<QString, QSet<QString> > mWatchedFileConfigs;
+    QHash<QString, QString> mWatchedFileStates;
+    QMutex mWatchMutex;
+    // rebuilds configs whose files changed, and prewarms configs
+    QThreadPool mRefreshPool;
+    // prewarm progress; prewarmConfigs may run on any thread, results arrive on the manager's
+    int mPrewarmTotal;
+    int mPrewarmDone;
+    int mPrewarmSucceeded;
+    QMutex mPrewarmMutex;
+
+    // guards in-memory session, row cache, provider and certificate cache state for concurrent
+    // callers; recursive, since locked calls nest; never held across input, key derivation or db access
+    mutable QMutex mMutex;
+    // serializes master password input, verification and reset, so concurrent callers wait for
+    // a single prompt; taken before mMutex, never while holding it
+    mutable QMutex mMasterPassMutex;
+
 #ifndef QT_NO_OPENSSL
     // mapping of sha1 digest and cert source and cert
     // appending removes duplicates
     QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> > mCaCertsCache;
-    // list of sha1 digests per policy
-    QMap<QgsAuthCertUtils::CertTrustPolicy, QStringList > mCertTrustCache;
-    // cache of certs ready to be utilized in network connections
+    // lower precedence copies of cached CAs, reinstated when the database CA overriding them is removed
+    QMap<QString, QPair<QgsAuthCertUtils::CaCertSource , QSslCertificate> > mShadowedCaCerts;
+
+    // trust index, keyed by binary sha1 digest: explicit policies of the trust table, and cached CAs
+    // partitioned by trust; default trust CAs are split on validity, so a default policy change only
+    // selects other partitions, and a single policy or CA change moves a single cert
+    enum CaTrustPartition
+    {
+      CaExplicitTrusted = 0,
+      CaExplicitUntrusted,
+      CaDefaultValid,
+      CaDefaultInvalid,
+      CaPartitionCount
+    };
+    QHash<QByteArray, QgsAuthCertUtils::CertTrustPolicy> mCertTrustPolicies;
+    QHash<QByteArray, QSslCertificate> mCaTrustPartitions[CaPartitionCount];
+    // when a default trust CA next expires or becomes effective, as msecs since epoch, 0 if never;
+    // default partitions are re-split on read once it has passed
+    qint64 mCaValidityRecheck;
+    // NoPolicy until read from settings
+    QgsAuthCertUtils::CertTrustPolicy mDefaultTrustPolicy;
+
+    // snapshot of certs ready to be utilized in network connections, as of an sslConfigGeneration and
+    // until a default trust CA's validity changes; under its own lock, so requests never wait on mMutex
     QList<QSslCertificate> mTrustedCaCertsCache;
+    int mTrustedCaCertsGeneration;
+    qint64 mTrustedCaCertsRecheck;
+    QReadWriteLock mTrustedCaCertsLock;
+
+    // extra CA file settings, and its filtered certs keyed by file state and allow invalid setting
+    bool mCaFileSettingsLoaded;
+    QString mCaFilePath;
+    bool mCaFileAllowInvalid;
+    QString mExtraFileCAsKey;
+    QList<QSslCertificate> mExtraFileCAs;
+    QAtomicInt mSslConfigGeneration;
+
+    // identity store entry: cert and metadata parsed once, private key decrypted on first use
+    struct IdentityEntry
+    {
+      IdentityEntry() : keyGeneration( -1 ) {}
+      QSslCertificate cert;
+      QString name;
+      QVariant keyBlob; // encrypted, as stored
+      QSslKey key;
+      int keyGeneration; // session in which key was decrypted
+    };
+    // in-memory copy of identities table, keyed by id (sha hash)
+    QMap<QString, IdentityEntry> mIdentities;
+    bool mIdentitiesLoaded;
+    QMutex mIdentitiesMutex;
+    // bumped on master password session reset, dropping decrypted keys without taking mIdentitiesMutex
+    QAtomicInt mIdentityKeyGeneration;
 #endif
 };
 
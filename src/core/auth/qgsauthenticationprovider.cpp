@@ -16,7 +16,8 @@
 
 #include "qgsauthenticationprovider.h"
 
-#include <QFile>
+#include <QDateTime>
+#include <QFileInfo>
 #ifndef QT_NO_OPENSSL
 #include <QtCrypto>
 #include <QSslConfiguration>
@@ -27,8 +28,45 @@
 #include "qgsauthenticationmanager.h"
 #include "qgslogger.h"
 
+//////////////////////////////////////////////////////
+// QgsAuthFailure
+//////////////////////////////////////////////////////
+
+QgsAuthFailure::QgsAuthFailure( const QString& reason, const QStringList& files )
+    : mReason( reason )
+    , mFiles( files )
+    , mFilesState( filesState( files ) )
+    , mCreated( QDateTime::currentMSecsSinceEpoch() )
+{
+}
+
+bool QgsAuthFailure::filesChanged() const
+{
+  return !mFiles.isEmpty() && filesState( mFiles ) != mFilesState;
+}
+
+// static
+const QString QgsAuthFailure::filesState( const QStringList& files )
+{
+  QString state;
+  foreach ( const QString& file, files )
+  {
+    QFileInfo fi( file );
+    state += QString( "%1:%2:%3;" )
+             .arg( fi.exists() ? 1 : 0 )
+             .arg( fi.exists() ? fi.size() : -1 )
+             .arg( fi.exists() ? fi.lastModified().toMSecsSinceEpoch() : -1 );
+  }
+  return state;
+}
+
+//////////////////////////////////////////////////////
+// QgsAuthProvider
+//////////////////////////////////////////////////////
+
 QgsAuthProvider::QgsAuthProvider( QgsAuthType::ProviderType providertype )
     : mType( providertype )
+    , mCacheGeneration( 0 )
 {
 }
 
@@ -51,16 +89,109 @@ bool QgsAuthProvider::urlToResource( const QString &accessurl, QString *resource
   return ( !res.isEmpty() );
 }
 
+QgsAuthFailure QgsAuthProvider::takeFailure( const QString& authcfg )
+{
+  QMutexLocker locker( &mFailuresMutex );
+  return mFailures.take( authcfg );
+}
+
+void QgsAuthProvider::setFailure( const QString& authcfg, const QString& reason, const QStringList& files )
+{
+  QgsDebugMsg( QString( "Update request FAILED for authcfg %1: %2" ).arg( authcfg ).arg( reason ) );
+  QMutexLocker locker( &mFailuresMutex );
+  mFailures.insert( authcfg, QgsAuthFailure( reason, files ) );
+}
+
+#ifndef QT_NO_OPENSSL
+// entries are small, so bounding by count suffices
+QgsAuthCache<QgsAuthProvider::SslServerEntry> QgsAuthProvider::mSslServerCache( "ssl servers", 256, 0, 3600 );
+
+void QgsAuthProvider::applyPkiBundle( QNetworkRequest &request, const QSharedPointer<QgsPkiBundle>& bundle )
+{
+  QgsAuthManager *authman = QgsAuthManager::instance();
+  QString hostport( QString( "%1:%2" ).arg( request.url().host() ).arg( request.url().port() ) );
+  // read before looking up, so a concurrent change leaves an already stale entry
+  int generation = authman->sslConfigGeneration();
+
+  SslServerEntry server;
+  if ( !mSslServerCache.lookup( hostport, &server ) || server.generation != generation )
+  {
+    QgsDebugMsg( QString( "Loading custom SSL server config for %1" ).arg( hostport ) );
+    QgsAuthConfigSslServer servconfig( authman->getSslCertCustomConfigByHost( hostport ) );
+    server.generation = generation;
+    server.custom = !servconfig.isNull();
+    if ( server.custom )
+    {
+      server.protocol = servconfig.sslProtocol();
+      server.verifymode = servconfig.sslPeerVerify().first;
+      server.verifydepth = servconfig.sslPeerVerify().second;
+    }
+    mSslServerCache.insert( hostport, server, sizeof( SslServerEntry ) + hostport.size() * sizeof( QChar ) );
+  }
+
+  // the caller's configuration is kept, only what the bundle and server config define is replaced;
+  // setters just swap implicitly shared data, and trusted CAs are a snapshot taken without the
+  // manager's lock, so this is cheap per request
+  QSslConfiguration sslconfig( request.sslConfiguration() );
+  sslconfig.setCaCertificates( authman->getTrustedCaCertsCache() );
+  sslconfig.setLocalCertificate( bundle->clientCert() );
+#if QT_VERSION >= 0x050100
+  if ( !bundle->caChain().isEmpty() )
+    sslconfig.setLocalCertificateChain( QList<QSslCertificate>() << bundle->clientCert() << bundle->caChain() );
+#endif
+  sslconfig.setPrivateKey( bundle->clientCertKey() );
+
+  if ( server.custom )
+  {
+    sslconfig.setProtocol( server.protocol );
+    sslconfig.setPeerVerifyMode( server.verifymode );
+    sslconfig.setPeerVerifyDepth( server.verifydepth );
+  }
+
+  request.setSslConfiguration( sslconfig );
+  request.setAttribute( sslConfigAppliedAttribute(), true );
+}
+#endif
+
+void QgsAuthProvider::cacheEvicted( const QString& name, const QString& key, QgsAuthCacheBase::EvictionReason reason )
+{
+#ifndef QGISDEBUG
+  Q_UNUSED( name );
+  Q_UNUSED( key );
+  Q_UNUSED( reason );
+#endif
+  QgsDebugMsg( QString( "Evicted %1 cache entry for authcfg %2: %3" )
+               .arg( name ).arg( key )
+               .arg( reason == QgsAuthCacheBase::Expired ? "idle expired" : "over capacity" ) );
+}
+
 
 //////////////////////////////////////////////////////
 // QgsAuthProviderBasic
 //////////////////////////////////////////////////////
 
-QMap<QString, QgsAuthConfigBasic> QgsAuthProviderBasic::mAuthBasicCache = QMap<QString, QgsAuthConfigBasic>();
+QgsAuthBasicBundle::QgsAuthBasicBundle( const QgsAuthConfigBasic& config )
+    : mConfig( config )
+{
+  if ( !config.username().isEmpty() )
+  {
+    mHeader = "Basic " + QString( "%1:%2" ).arg( config.username() ).arg( config.password() ).toAscii().toBase64();
+  }
+}
+
+int QgsAuthBasicBundle::cost() const
+{
+  return sizeof( QgsAuthBasicBundle ) + mHeader.size()
+         + ( mConfig.username().size() + mConfig.password().size() + mConfig.realm().size() ) * sizeof( QChar );
+}
+
+QgsAuthCache< QSharedPointer<QgsAuthBasicBundle> > QgsAuthProviderBasic::mAuthBasicCache( "basic" );
 
 QgsAuthProviderBasic::QgsAuthProviderBasic()
     : QgsAuthProvider( QgsAuthType::Basic )
 {
+  mAuthBasicCache.setLimitsFromSettings();
+  mAuthBasicCache.setEvictionCallback( cacheEvicted );
 }
 
 QgsAuthProviderBasic::~QgsAuthProviderBasic()
@@ -70,19 +201,16 @@ QgsAuthProviderBasic::~QgsAuthProviderBasic()
 
 bool QgsAuthProviderBasic::updateNetworkRequest( QNetworkRequest& request, const QString& authcfg )
 {
-  QgsAuthConfigBasic config = getAuthBasicConfig( authcfg );
-  if ( !config.isValid() )
+  QSharedPointer<QgsAuthBasicBundle> bundle( getAuthBasicBundle( authcfg ) );
+  if ( !bundle || !bundle->config().isValid() )
   {
     QgsDebugMsg( QString( "Update request config FAILED for authcfg: %1: basic config invalid" ).arg( authcfg ) );
     return false;
   }
 
-  QString username = config.username();
-  QString password = config.password();
-
-  if ( !username.isEmpty() )
+  if ( !bundle->authorizationHeader().isEmpty() )
   {
-    request.setRawHeader( "Authorization", "Basic " + QString( "%1:%2" ).arg( username ).arg( password ).toAscii().toBase64() );
+    request.setRawHeader( "Authorization", bundle->authorizationHeader() );
   }
   return true;
 }
@@ -94,49 +222,60 @@ bool QgsAuthProviderBasic::updateNetworkReply( QNetworkReply *reply, const QStri
   return true;
 }
 
-QgsAuthConfigBasic QgsAuthProviderBasic::getAuthBasicConfig( const QString& authcfg )
+QSharedPointer<QgsAuthBasicBundle> QgsAuthProviderBasic::getAuthBasicBundle( const QString& authcfg )
 {
-  QgsAuthConfigBasic config;
+  QSharedPointer<QgsAuthBasicBundle> bundle;
 
   // check if it is cached
-  if ( mAuthBasicCache.contains( authcfg ) )
+  if ( mAuthBasicCache.lookup( authcfg, &bundle ) && bundle )
   {
-    config = mAuthBasicCache.value( authcfg );
     QgsDebugMsg( QString( "Retrieved basic bundle for authcfg %1" ).arg( authcfg ) );
-    return config;
+    return bundle;
   }
 
-  // else build basic bundle
+  // else build basic bundle, outside of lock; concurrent builds of the same config are harmless
+  int generation = cacheGeneration();
+  QgsAuthConfigBasic config;
   if ( !QgsAuthManager::instance()->loadAuthenticationConfig( authcfg, config, true ) )
   {
-    QgsDebugMsg( QString( "Basic bundle for authcfg %1: FAILED to retrieve config" ).arg( authcfg ) );
-    return config;
+    setFailure( authcfg, QObject::tr( "Config could not be loaded from database" ) );
+    return bundle;
   }
 
+  bundle = QSharedPointer<QgsAuthBasicBundle>( new QgsAuthBasicBundle( config ) );
+
   // cache bundle
-  putAuthBasicConfig( authcfg, config );
+  putAuthBasicBundle( authcfg, bundle, generation );
 
-  return config;
+  return bundle;
 }
 
-void QgsAuthProviderBasic::putAuthBasicConfig( const QString& authcfg, QgsAuthConfigBasic config )
+void QgsAuthProviderBasic::putAuthBasicBundle( const QString& authcfg, const QSharedPointer<QgsAuthBasicBundle>& bundle, int generation )
 {
-  QgsDebugMsg( QString( "Putting basic config for authcfg %1" ).arg( authcfg ) );
-  mAuthBasicCache.insert( authcfg, config );
+  if ( cacheGenerationChanged( generation ) )
+  {
+    QgsDebugMsg( QString( "Putting basic bundle SKIPPED for authcfg %1: cleared while building" ).arg( authcfg ) );
+    return;
+  }
+  QgsDebugMsg( QString( "Putting basic bundle for authcfg %1" ).arg( authcfg ) );
+  mAuthBasicCache.insert( authcfg, bundle, bundle ? bundle->cost() : 0 );
+  // cleared between the check and the insert: drop the stale bundle
+  if ( cacheGenerationChanged( generation ) )
+    removeAuthBasicBundle( authcfg );
 }
 
-void QgsAuthProviderBasic::removeAuthBasicConfig( const QString& authcfg )
+void QgsAuthProviderBasic::removeAuthBasicBundle( const QString& authcfg )
 {
-  if ( mAuthBasicCache.contains( authcfg ) )
+  if ( mAuthBasicCache.remove( authcfg ) )
   {
-    mAuthBasicCache.remove( authcfg );
-    QgsDebugMsg( QString( "Removed basic config for authcfg: %1" ).arg( authcfg ) );
+    QgsDebugMsg( QString( "Removed basic bundle for authcfg: %1" ).arg( authcfg ) );
   }
 }
 
 void QgsAuthProviderBasic::clearCachedConfig( const QString& authcfg )
 {
-  Q_UNUSED( authcfg );
+  invalidateCacheGeneration();
+  removeAuthBasicBundle( authcfg );
 }
 
 
@@ -164,50 +303,31 @@ bool QgsPkiBundle::isValid()
   return ( !mCert.isNull() && !mCertKey.isNull() );
 }
 
-//////////////////////////////////////////////////////
-// Local Functions
-//////////////////////////////////////////////////////
-
-static QByteArray fileData_( const QString& path, bool astext = false )
+int QgsPkiBundle::cost() const
 {
-  QByteArray data;
-  QFile file( path );
-  if ( file.exists() )
+  int cost = sizeof( QgsPkiBundle ) + mCert.toDer().size() + mCertKey.toDer().size();
+  Q_FOREACH ( const QSslCertificate& cacert, mCaChain )
   {
-    QFile::OpenMode openflags( QIODevice::ReadOnly );
-    if ( astext )
-      openflags |= QIODevice::Text;
-    bool ret = file.open( openflags );
-    if ( ret )
-    {
-      data = file.readAll();
-    }
-    file.close();
+    cost += cacert.toDer().size();
   }
-  return data;
-}
-
-QSsl::KeyAlgorithm pemKeyAlgorithm_( const QByteArray& keydata )
-{
-  QString keytxt( keydata );
-  return ( keytxt.contains( "BEGIN DSA P" ) ? QSsl::Dsa : QSsl::Rsa );
+  return cost;
 }
 
 //////////////////////////////////////////////////////
 // QgsAuthProviderPkiPaths
 //////////////////////////////////////////////////////
 
-QMap<QString, QgsPkiBundle *> QgsAuthProviderPkiPaths::mPkiBundleCache = QMap<QString, QgsPkiBundle *>();
+QgsAuthCache< QSharedPointer<QgsPkiBundle> > QgsAuthProviderPkiPaths::mPkiBundleCache( "pki" );
 
 QgsAuthProviderPkiPaths::QgsAuthProviderPkiPaths()
     : QgsAuthProvider( QgsAuthType::PkiPaths )
 {
-
+  mPkiBundleCache.setLimitsFromSettings();
+  mPkiBundleCache.setEvictionCallback( cacheEvicted );
 }
 
 QgsAuthProviderPkiPaths::~QgsAuthProviderPkiPaths()
 {
-  qDeleteAll( mPkiBundleCache.values() );
   mPkiBundleCache.clear();
 }
 
@@ -222,22 +342,17 @@ bool QgsAuthProviderPkiPaths::updateNetworkRequest( QNetworkRequest &request, co
 
   QgsDebugMsg( QString( "Update request SSL config: HTTPS connection for authcfg: %1" ).arg( authcfg ) );
 
-  QgsPkiBundle * pkibundle = getPkiBundle( authcfg );
+  QSharedPointer<QgsPkiBundle> pkibundle( getPkiBundle( authcfg ) );
   if ( !pkibundle || !pkibundle->isValid() )
   {
     QgsDebugMsg( QString( "Update request SSL config FAILED for authcfg: %1: PKI bundle invalid" ).arg( authcfg ) );
+    // getPkiBundle records the specific reason
     return false;
   }
 
   QgsDebugMsg( QString( "Update request SSL config: PKI bundle valid for authcfg: %1" ).arg( authcfg ) );
 
-  QSslConfiguration sslConfig = request.sslConfiguration();
-  //QSslConfiguration sslConfig( QSslConfiguration::defaultConfiguration() );
-
-  sslConfig.setLocalCertificate( pkibundle->clientCert() );
-  sslConfig.setPrivateKey( pkibundle->clientCertKey() );
-
-  request.setSslConfiguration( sslConfig );
+  applyPkiBundle( request, pkibundle );
 
   return true;
 }
@@ -251,26 +366,15 @@ bool QgsAuthProviderPkiPaths::updateNetworkReply( QNetworkReply *reply, const QS
 
 void QgsAuthProviderPkiPaths::clearCachedConfig( const QString& authcfg )
 {
-  QgsPkiBundle * pkibundle = 0;
-  // check if it is cached
-  if ( mPkiBundleCache.contains( authcfg ) )
-  {
-    pkibundle = mPkiBundleCache.take( authcfg );
-    delete pkibundle;
-    pkibundle = 0;
-  }
+  invalidateCacheGeneration();
+  removePkiBundle( authcfg );
 }
 
 // static
 const QByteArray QgsAuthProviderPkiPaths::certAsPem( const QString &certpath )
 {
-  bool pem = certpath.endsWith( ".pem", Qt::CaseInsensitive );
-  if ( pem )
-  {
-    return fileData_( certpath, pem );
-  }
-  QSslCertificate clientcert( fileData_( certpath ), QSsl::Der );
-  return ( !clientcert.isNull() ? clientcert.toPem() : QByteArray() );
+  QList<QSslCertificate> certs( QgsAuthCertUtils::certsFromFile( certpath ) );
+  return ( !certs.isEmpty() ? certs.first().toPem() : QByteArray() );
 }
 
 // static
@@ -279,116 +383,92 @@ const QByteArray QgsAuthProviderPkiPaths::keyAsPem( const QString &keypath,
     QString *algtype,
     bool reencrypt )
 {
-  bool pem = keypath.endsWith( ".pem", Qt::CaseInsensitive );
-  QByteArray keydata( fileData_( keypath, pem ) );
-
-  QSslKey clientkey;
-  clientkey = QSslKey( keydata,
-                       QSsl::Rsa,
-                       pem ? QSsl::Pem : QSsl::Der,
-                       QSsl::PrivateKey,
-                       !keypass.isEmpty() ? keypass.toUtf8() : QByteArray() );
+  QSslKey clientkey( QgsAuthCertUtils::keyFromFile( keypath, keypass, algtype ) );
   if ( clientkey.isNull() )
   {
-    // try DSA algorithm, since Qt can't seem to determine it otherwise
-    clientkey = QSslKey( keydata,
-                         QSsl::Dsa,
-                         pem ? QSsl::Pem : QSsl::Der,
-                         QSsl::PrivateKey,
-                         !keypass.isEmpty() ? keypass.toUtf8() : QByteArray() );
-    if ( clientkey.isNull() )
-    {
-      return QByteArray();
-    }
-    if ( algtype )
-      *algtype = "dsa";
-  }
-  else
-  {
-    if ( algtype )
-      *algtype = "rsa";
+    return QByteArray();
   }
 
   // reapply passphrase if protection is requested and passphrase exists
   return ( clientkey.toPem( reencrypt && !keypass.isEmpty() ? keypass.toUtf8() : QByteArray() ) );
 }
 
-QgsPkiBundle *QgsAuthProviderPkiPaths::getPkiBundle( const QString& authcfg )
+QSharedPointer<QgsPkiBundle> QgsAuthProviderPkiPaths::cachedPkiBundle( const QString& authcfg )
+{
+  QSharedPointer<QgsPkiBundle> bundle;
+  mPkiBundleCache.lookup( authcfg, &bundle );
+  return bundle;
+}
+
+QSharedPointer<QgsPkiBundle> QgsAuthProviderPkiPaths::getPkiBundle( const QString& authcfg )
 {
-  QgsPkiBundle * bundle = 0;
+  QSharedPointer<QgsPkiBundle> bundle;
 
   // check if it is cached
-  if ( mPkiBundleCache.contains( authcfg ) )
+  bundle = cachedPkiBundle( authcfg );
+  if ( bundle )
   {
-    bundle = mPkiBundleCache.value( authcfg );
-    if ( bundle )
-    {
-      QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
-      return bundle;
-    }
+    QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
+    return bundle;
   }
 
-  // else build PKI bundle
+  // else build PKI bundle, outside of lock
+  int generation = cacheGeneration();
   QgsAuthConfigPkiPaths config;
 
   if ( !QgsAuthManager::instance()->loadAuthenticationConfig( authcfg, config, true ) )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: FAILED to retrieve config" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Config could not be loaded from database" ) );
     return bundle;
   }
 
-  // init client cert
+  // init client cert, decoded directly from the file's PEM or DER; any further certs are its chain
   // Note: if this is not valid, no sense continuing
-  QSslCertificate clientcert( QgsAuthProviderPkiPaths::certAsPem( config.certId() ) );
+  QList<QSslCertificate> certs( QgsAuthCertUtils::certsFromFile( config.certId() ) );
+  QSslCertificate clientcert( !certs.isEmpty() ? certs.takeFirst() : QSslCertificate() );
   if ( !clientcert.isValid() )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, client cert is not valid" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate is missing or not valid" ), QStringList() << config.certId() << config.keyId() );
     return bundle;
   }
 
-  // init key
-  QString algtype;
-  QByteArray keydata( QgsAuthProviderPkiPaths::keyAsPem( config.keyId(), config.keyPassphrase(), &algtype ) );
-
-  if ( keydata.isNull() )
-  {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, no key data read" ).arg( authcfg ) );
-    return bundle;
-  }
-
-  QSslKey clientkey( keydata,
-                     ( algtype == "rsa" ) ? QSsl::Rsa : QSsl::Dsa,
-                     QSsl::Pem,
-                     QSsl::PrivateKey,
-                     !config.keyPassphrase().isEmpty() ? config.keyPassphrase().toUtf8() : QByteArray() );
-
+  // init key, decoded once with format and algorithm sniffed from content
+  QSslKey clientkey( QgsAuthCertUtils::keyFromFile( config.keyId(), config.keyPassphrase() ) );
   if ( clientkey.isNull() )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, PEM cert key could not be created" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate key could not be read" ), QStringList() << config.certId() << config.keyId() );
     return bundle;
   }
 
-  bundle = new QgsPkiBundle( config, clientcert, clientkey );
+  bundle = QSharedPointer<QgsPkiBundle>( new QgsPkiBundle( config, clientcert, clientkey ) );
+  bundle->setCaChain( certs );
 
-  // cache bundle
-  putPkiBundle( authcfg, bundle );
+  // cache bundle, rebuilt if its files are rotated
+  putPkiBundle( authcfg, bundle, generation );
+  QgsAuthManager::instance()->watchConfigFiles( authcfg, QStringList() << config.certId() << config.keyId() );
 
   return bundle;
 }
 
-void QgsAuthProviderPkiPaths::putPkiBundle( const QString &authcfg, QgsPkiBundle *pkibundle )
+void QgsAuthProviderPkiPaths::putPkiBundle( const QString &authcfg, const QSharedPointer<QgsPkiBundle>& pkibundle, int generation )
 {
+  if ( cacheGenerationChanged( generation ) )
+  {
+    QgsDebugMsg( QString( "Putting PKI bundle SKIPPED for authcfg %1: cleared while building" ).arg( authcfg ) );
+    return;
+  }
   QgsDebugMsg( QString( "Putting PKI bundle for authcfg %1" ).arg( authcfg ) );
-  mPkiBundleCache.insert( authcfg, pkibundle );
+  // a replaced or evicted bundle is deleted once its last user releases it
+  mPkiBundleCache.insert( authcfg, pkibundle, pkibundle ? pkibundle->cost() : 0 );
+  // cleared between the check and the insert: drop the stale bundle
+  if ( cacheGenerationChanged( generation ) )
+    removePkiBundle( authcfg );
 }
 
 void QgsAuthProviderPkiPaths::removePkiBundle( const QString& authcfg )
 {
-  if ( mPkiBundleCache.contains( authcfg ) )
+  if ( mPkiBundleCache.remove( authcfg ) )
   {
-    QgsPkiBundle * pkibundle = mPkiBundleCache.take( authcfg );
-    delete pkibundle;
-    pkibundle = 0;
     QgsDebugMsg( QString( "Removed PKI bundle for authcfg: %1" ).arg( authcfg ) );
   }
 }
@@ -397,8 +477,6 @@ void QgsAuthProviderPkiPaths::removePkiBundle( const QString& authcfg )
 // QgsAuthProviderPkiPkcs12
 //////////////////////////////////////////////////////
 
-QMap<QString, QgsPkiBundle *> QgsAuthProviderPkiPkcs12::mPkiBundleCache = QMap<QString, QgsPkiBundle *>();
-
 QgsAuthProviderPkiPkcs12::QgsAuthProviderPkiPkcs12()
     : QgsAuthProviderPkiPaths()
 {
@@ -409,6 +487,12 @@ QgsAuthProviderPkiPkcs12::~QgsAuthProviderPkiPkcs12()
 {
 }
 
+void QgsAuthProviderPkiPkcs12::clearCachedConfig( const QString& authcfg )
+{
+  QgsAuthProviderPkiPaths::clearCachedConfig( authcfg );
+  mPkcs12Cache.remove( authcfg );
+}
+
 QCA::KeyBundle keyBundle_( const QString &path, const QString &pass )
 {
   QCA::SecureArray passarray;
@@ -419,93 +503,146 @@ QCA::KeyBundle keyBundle_( const QString &path, const QString &pass )
   return ( res == QCA::ConvertGood ? bundle : QCA::KeyBundle() );
 }
 
+QgsAuthCache<QgsAuthProviderPkiPkcs12::Pkcs12Entry> QgsAuthProviderPkiPkcs12::mPkcs12Cache( "pkcs12", 16, 0, 60 );
+
 // static
-const QString QgsAuthProviderPkiPkcs12::certAsPem( const QString &bundlepath, const QString &bundlepass )
+bool QgsAuthProviderPkiPkcs12::loadBundle( const QString &bundlepath, const QString &bundlepass,
+    QSslCertificate *cert, QSslKey *key,
+    QList<QSslCertificate> *cachain,
+    const QString &authcfg, QString *keyalg )
 {
-  QString cert;
   if ( !QCA::isSupported( "pkcs12" ) )
-    return cert;
+    return false;
+
+  QFileInfo fi( bundlepath );
+  if ( !fi.exists() )
+    return false;
+
+  // the passphrase is part of the config, which is removed from cache when it changes
+  QString filestate( QString( "%1|%2|%3" )
+                     .arg( fi.absoluteFilePath() )
+                     .arg( fi.size() )
+                     .arg( fi.lastModified().toMSecsSinceEpoch() ) );
+
+  Pkcs12Entry entry;
+  if ( authcfg.isEmpty() || !mPkcs12Cache.lookup( authcfg, &entry ) || entry.filestate != filestate )
+  {
+    entry = Pkcs12Entry();
+    entry.filestate = filestate;
+
+    QCA::KeyBundle bundle( keyBundle_( bundlepath, bundlepass ) );
+    if ( bundle.isNull() )
+      return false;
+
+    QCA::CertificateChain chain( bundle.certificateChain() );
+    QCA::PrivateKey privkey( bundle.privateKey() );
+    if ( chain.isEmpty() || privkey.isNull() )
+      return false;
 
-  QCA::KeyBundle bundle( keyBundle_( bundlepath, bundlepass ) );
-  if ( bundle.isNull() )
-    return cert;
+    // certs go straight from DER; primary is first in chain
+    int cost = sizeof( Pkcs12Entry );
+    for ( int i = 0; i < chain.size(); ++i )
+    {
+      QByteArray der( chain.at( i ).toDER() );
+      cost += der.size();
+      if ( i == 0 )
+        entry.cert = QSslCertificate( der, QSsl::Der );
+      else
+        entry.cachain << QSslCertificate( der, QSsl::Der );
+    }
+
+    // QCA exports keys as PKCS#8; algorithm (RSA, DSA or EC) is read from the key itself
+    QByteArray keypem( privkey.toPEM().toAscii() );
+    cost += keypem.size();
+    entry.key = QgsAuthCertUtils::keyFromData( keypem, QString(), &entry.keyalg );
+
+    if ( entry.cert.isNull() || entry.key.isNull() )
+      return false;
+
+    if ( !authcfg.isEmpty() )
+      mPkcs12Cache.insert( authcfg, entry, cost );
+  }
 
-  return bundle.certificateChain().primary().toPEM();
+  if ( cert )
+    *cert = entry.cert;
+  if ( key )
+    *key = entry.key;
+  if ( cachain )
+    *cachain = entry.cachain;
+  if ( keyalg )
+    *keyalg = entry.keyalg;
+  return true;
 }
 
 // static
-const QString QgsAuthProviderPkiPkcs12::keyAsPem( const QString &bundlepath, const QString &bundlepass, bool reencrypt )
+const QString QgsAuthProviderPkiPkcs12::certAsPem( const QString &bundlepath, const QString &bundlepass )
 {
-  QString key;
-  if ( !QCA::isSupported( "pkcs12" ) )
-    return key;
+  QSslCertificate cert;
+  if ( !loadBundle( bundlepath, bundlepass, &cert, 0 ) )
+    return QString();
 
-  QCA::KeyBundle bundle( keyBundle_( bundlepath, bundlepass ) );
-  if ( bundle.isNull() )
-    return key;
+  return QString( cert.toPem() );
+}
 
-  QCA::SecureArray passarray;
-  if ( reencrypt && !bundlepass.isEmpty() )
-    passarray = QCA::SecureArray( bundlepass.toUtf8() );
+// static
+const QString QgsAuthProviderPkiPkcs12::keyAsPem( const QString &bundlepath, const QString &bundlepass,
+    bool reencrypt, QString *algtype )
+{
+  QSslKey key;
+  if ( !loadBundle( bundlepath, bundlepass, 0, &key, 0, QString(), algtype ) )
+    return QString();
 
-  return bundle.privateKey().toPEM( passarray );
+  // reapply passphrase if protection is requested and passphrase exists
+  return QString( key.toPem( reencrypt && !bundlepass.isEmpty() ? bundlepass.toUtf8() : QByteArray() ) );
 }
 
-QgsPkiBundle *QgsAuthProviderPkiPkcs12::getPkiBundle( const QString &authcfg )
+QSharedPointer<QgsPkiBundle> QgsAuthProviderPkiPkcs12::getPkiBundle( const QString &authcfg )
 {
-  QgsPkiBundle * bundle = 0;
+  QSharedPointer<QgsPkiBundle> bundle;
 
-  // check if it is cached
-  if ( mPkiBundleCache.contains( authcfg ) )
+  // check if it is cached (shares the PKI paths cache, which putPkiBundle fills)
+  bundle = cachedPkiBundle( authcfg );
+  if ( bundle )
   {
-    bundle = mPkiBundleCache.value( authcfg );
-    if ( bundle )
-    {
-      QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
-      return bundle;
-    }
+    QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
+    return bundle;
   }
 
-  // else build PKI bundle
+  // else build PKI bundle, outside of lock
+  int generation = cacheGeneration();
   QgsAuthConfigPkiPkcs12 config;
 
   if ( !QgsAuthManager::instance()->loadAuthenticationConfig( authcfg, config, true ) )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: FAILED to retrieve config" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Config could not be loaded from database" ) );
     return bundle;
   }
 
-  // init client cert
-  // Note: if this is not valid, no sense continuing
-  QSslCertificate clientcert( QgsAuthProviderPkiPkcs12::certAsPem( config.bundlePath(), config.bundlePassphrase() ).toAscii() );
-  if ( !clientcert.isValid() )
+  // cert, chain and key from a single parse of the bundle
+  QSslCertificate clientcert;
+  QSslKey clientkey;
+  QList<QSslCertificate> cachain;
+  if ( !loadBundle( config.bundlePath(), config.bundlePassphrase(), &clientcert, &clientkey, &cachain, authcfg ) )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, client cert is not valid" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate bundle could not be read, or has no certificate or key" ), QStringList() << config.bundlePath() );
     return bundle;
   }
 
-  // init key
-  QByteArray keydata( QgsAuthProviderPkiPkcs12::keyAsPem( config.bundlePath(), config.bundlePassphrase() ).toAscii() );
-
-  if ( keydata.isNull() )
+  // Note: if this is not valid, no sense continuing
+  if ( !clientcert.isValid() )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, no key data read" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate is missing or not valid" ), QStringList() << config.bundlePath() );
     return bundle;
   }
 
-  QSslKey clientkey( keydata,
-                     QSsl::Rsa,
-                     QSsl::Pem,
-                     QSsl::PrivateKey,
-                     !config.bundlePassphrase().isNull() ? config.bundlePassphrase().toUtf8() : QByteArray() );
-
-  bundle = new QgsPkiBundle( config, clientcert, clientkey );
+  bundle = QSharedPointer<QgsPkiBundle>( new QgsPkiBundle( config, clientcert, clientkey ) );
+  bundle->setCaChain( cachain );
 
-  // cache bundle
-  putPkiBundle( authcfg, bundle );
+  // cache bundle, rebuilt if its file is rotated
+  putPkiBundle( authcfg, bundle, generation );
+  QgsAuthManager::instance()->watchConfigFiles( authcfg, QStringList() << config.bundlePath() );
 
   return bundle;
-
 }
 
 
@@ -513,16 +650,17 @@ QgsPkiBundle *QgsAuthProviderPkiPkcs12::getPkiBundle( const QString &authcfg )
 // QgsAuthProviderIdentityCert
 //////////////////////////////////////////////////////
 
-QMap<QString, QgsPkiBundle *> QgsAuthProviderIdentityCert::mPkiBundleCache = QMap<QString, QgsPkiBundle *>();
+QgsAuthCache< QSharedPointer<QgsPkiBundle> > QgsAuthProviderIdentityCert::mPkiBundleCache( "identity" );
 
 QgsAuthProviderIdentityCert::QgsAuthProviderIdentityCert()
     : QgsAuthProvider( QgsAuthType::IdentityCert )
 {
+  mPkiBundleCache.setLimitsFromSettings();
+  mPkiBundleCache.setEvictionCallback( cacheEvicted );
 }
 
 QgsAuthProviderIdentityCert::~QgsAuthProviderIdentityCert()
 {
-  qDeleteAll( mPkiBundleCache.values() );
   mPkiBundleCache.clear();
 }
 
@@ -537,22 +675,17 @@ bool QgsAuthProviderIdentityCert::updateNetworkRequest( QNetworkRequest &request
 
   QgsDebugMsg( QString( "Update request SSL config: HTTPS connection for authcfg: %1" ).arg( authcfg ) );
 
-  QgsPkiBundle * pkibundle = getPkiBundle( authcfg );
+  QSharedPointer<QgsPkiBundle> pkibundle( getPkiBundle( authcfg ) );
   if ( !pkibundle || !pkibundle->isValid() )
   {
     QgsDebugMsg( QString( "Update request SSL config FAILED for authcfg: %1: PKI bundle invalid" ).arg( authcfg ) );
+    // getPkiBundle records the specific reason
     return false;
   }
 
   QgsDebugMsg( QString( "Update request SSL config: PKI bundle valid for authcfg: %1" ).arg( authcfg ) );
 
-  QSslConfiguration sslConfig = request.sslConfiguration();
-  //QSslConfiguration sslConfig( QSslConfiguration::defaultConfiguration() );
-
-  sslConfig.setLocalCertificate( pkibundle->clientCert() );
-  sslConfig.setPrivateKey( pkibundle->clientCertKey() );
-
-  request.setSslConfiguration( sslConfig );
+  applyPkiBundle( request, pkibundle );
 
   return true;
 }
@@ -566,14 +699,8 @@ bool QgsAuthProviderIdentityCert::updateNetworkReply( QNetworkReply *reply, cons
 
 void QgsAuthProviderIdentityCert::clearCachedConfig( const QString& authcfg )
 {
-  QgsPkiBundle * pkibundle = 0;
-  // check if it is cached
-  if ( mPkiBundleCache.contains( authcfg ) )
-  {
-    pkibundle = mPkiBundleCache.take( authcfg );
-    delete pkibundle;
-    pkibundle = 0;
-  }
+  invalidateCacheGeneration();
+  removePkiBundle( authcfg );
 }
 
 // static
@@ -601,27 +728,24 @@ const QByteArray QgsAuthProviderIdentityCert::keyAsPem( const QString &certid,
   return ( cibundle.second.toPem( reencrypt && !keypass.isEmpty() ? keypass.toUtf8() : QByteArray() ) );
 }
 
-QgsPkiBundle *QgsAuthProviderIdentityCert::getPkiBundle( const QString& authcfg )
+QSharedPointer<QgsPkiBundle> QgsAuthProviderIdentityCert::getPkiBundle( const QString& authcfg )
 {
-  QgsPkiBundle * bundle = 0;
+  QSharedPointer<QgsPkiBundle> bundle;
 
   // check if it is cached
-  if ( mPkiBundleCache.contains( authcfg ) )
+  if ( mPkiBundleCache.lookup( authcfg, &bundle ) && bundle )
   {
-    bundle = mPkiBundleCache.value( authcfg );
-    if ( bundle )
-    {
-      QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
-      return bundle;
-    }
+    QgsDebugMsg( QString( "Retrieved PKI bundle for authcfg %1" ).arg( authcfg ) );
+    return bundle;
   }
 
-  // else build PKI bundle
+  // else build PKI bundle, outside of lock
+  int generation = cacheGeneration();
   QgsAuthConfigIdentityCert config;
 
   if ( !QgsAuthManager::instance()->loadAuthenticationConfig( authcfg, config, true ) )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: FAILED to retrieve config" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Config could not be loaded from database" ) );
     return bundle;
   }
 
@@ -633,7 +757,7 @@ QgsPkiBundle *QgsAuthProviderIdentityCert::getPkiBundle( const QString& authcfg
   QSslCertificate clientcert( cibundle.first );
   if ( !clientcert.isValid() )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, client cert is not valid" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate is missing or not valid" ) );
     return bundle;
   }
 
@@ -641,31 +765,37 @@ QgsPkiBundle *QgsAuthProviderIdentityCert::getPkiBundle( const QString& authcfg
   QSslKey clientkey( cibundle.second );
   if ( clientkey.isNull() )
   {
-    QgsDebugMsg( QString( "PKI bundle for authcfg %1: insert FAILED, PEM cert key could not be created" ).arg( authcfg ) );
+    setFailure( authcfg, QObject::tr( "Client certificate key could not be created" ) );
     return bundle;
   }
 
-  bundle = new QgsPkiBundle( config, clientcert, clientkey );
+  bundle = QSharedPointer<QgsPkiBundle>( new QgsPkiBundle( config, clientcert, clientkey ) );
 
   // cache bundle
-  putPkiBundle( authcfg, bundle );
+  putPkiBundle( authcfg, bundle, generation );
 
   return bundle;
 }
 
-void QgsAuthProviderIdentityCert::putPkiBundle( const QString &authcfg, QgsPkiBundle *pkibundle )
+void QgsAuthProviderIdentityCert::putPkiBundle( const QString &authcfg, const QSharedPointer<QgsPkiBundle>& pkibundle, int generation )
 {
+  if ( cacheGenerationChanged( generation ) )
+  {
+    QgsDebugMsg( QString( "Putting PKI bundle SKIPPED for authcfg %1: cleared while building" ).arg( authcfg ) );
+    return;
+  }
   QgsDebugMsg( QString( "Putting PKI bundle for authcfg %1" ).arg( authcfg ) );
-  mPkiBundleCache.insert( authcfg, pkibundle );
+  // a replaced or evicted bundle is deleted once its last user releases it
+  mPkiBundleCache.insert( authcfg, pkibundle, pkibundle ? pkibundle->cost() : 0 );
+  // cleared between the check and the insert: drop the stale bundle
+  if ( cacheGenerationChanged( generation ) )
+    removePkiBundle( authcfg );
 }
 
 void QgsAuthProviderIdentityCert::removePkiBundle( const QString& authcfg )
 {
-  if ( mPkiBundleCache.contains( authcfg ) )
+  if ( mPkiBundleCache.remove( authcfg ) )
   {
-    QgsPkiBundle * pkibundle = mPkiBundleCache.take( authcfg );
-    delete pkibundle;
-    pkibundle = 0;
     QgsDebugMsg( QString( "Removed PKI bundle for authcfg: %1" ).arg( authcfg ) );
   }
 }
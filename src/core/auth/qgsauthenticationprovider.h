@@ -17,18 +17,59 @@
 #ifndef QGSAUTHENTICATIONPROVIDER_H
 #define QGSAUTHENTICATIONPROVIDER_H
 
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
 #include <QObject>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QSharedPointer>
+#include <QStringList>
 #include <QUrl>
 
 #ifndef QT_NO_OPENSSL
 #include <QSslCertificate>
+#include <QSslConfiguration>
 #include <QSslKey>
 #endif
 
+#include "qgsauthenticationcache.h"
 #include "qgsauthenticationconfig.h"
 
+#ifndef QT_NO_OPENSSL
+class QgsPkiBundle;
+#endif
+
+/** \ingroup core
+ * \brief Why a provider could not apply a config, with a snapshot of the files it depends on
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthFailure
+{
+  public:
+    explicit QgsAuthFailure( const QString& reason = QString(), const QStringList& files = QStringList() );
+
+    bool isNull() const { return mReason.isEmpty(); }
+
+    const QString reason() const { return mReason; }
+
+    const QStringList files() const { return mFiles; }
+
+    /** When the failure occurred, in msecs since epoch */
+    qint64 created() const { return mCreated; }
+
+    /** Whether any referenced file was created, removed or modified since the failure */
+    bool filesChanged() const;
+
+  private:
+    static const QString filesState( const QStringList& files );
+
+    QString mReason;
+    QStringList mFiles;
+    QString mFilesState;
+    qint64 mCreated;
+};
+
 /** \ingroup core
  * \brief Base authentication provider class (not meant to be directly used)
  * \since 2.8
@@ -53,11 +94,98 @@ class CORE_EXPORT QgsAuthProvider
 
     virtual void clearCachedConfig( const QString& authcfg ) = 0;
 
+    /** Build and cache a config's credentials ahead of use, e.g. from a background thread
+     * @return Whether the config could be built
+     */
+    virtual bool warmCachedConfig( const QString& authcfg ) { Q_UNUSED( authcfg ); return true; }
+
+    /** Size and hit/miss/eviction counters of the provider's credential cache */
+    virtual QgsAuthCacheStats cacheStats() const { return QgsAuthCacheStats(); }
+
+    /** Take the failure recorded by the last failed update for a config, if any */
+    QgsAuthFailure takeFailure( const QString& authcfg );
+
+    /** Request attribute set once a provider applied a complete SSL configuration, trusted CAs included
+     * @note QgsNetworkAccessManager then does not add CAs or custom server config again
+     */
+    static QNetworkRequest::Attribute sslConfigAppliedAttribute() { return ( QNetworkRequest::Attribute )( QNetworkRequest::User + 1 ); }
+
   protected:
     static const QString authProviderTag() { return QObject::tr( "Authentication provider" ); }
 
+    /** Record (and log) why a config could not be applied
+     * @param files Files the config references, whose change should retry it
+     */
+    void setFailure( const QString& authcfg, const QString& reason, const QStringList& files = QStringList() );
+
+    /** Eviction callback for provider caches, which logs the eviction */
+    static void cacheEvicted( const QString& name, const QString& key, QgsAuthCacheBase::EvictionReason reason );
+
+    /** Generation of cached configs, changed whenever one is cleared; read before building
+     * credentials, so they are not cached if cleared meanwhile (see cacheGenerationChanged)
+     */
+    int cacheGeneration() const { return mCacheGeneration; }
+
+    /** Whether a config was cleared since the generation was read */
+    bool cacheGenerationChanged( int generation ) const { return ( int )mCacheGeneration != generation; }
+
+    /** Mark cached configs stale, before removing one from a cache */
+    void invalidateCacheGeneration() { mCacheGeneration.ref(); }
+
+#ifndef QT_NO_OPENSSL
+    /**
+     * Apply client cert and key to an HTTPS request's SSL configuration, along with
+     * trusted CAs and any custom server config for its host:port
+     * @note Custom server configs are cached per host:port, until the manager's SSL config generation changes
+     */
+    void applyPkiBundle( QNetworkRequest &request, const QSharedPointer<QgsPkiBundle>& bundle );
+#endif
+
   private:
     QgsAuthType::ProviderType mType;
+    QAtomicInt mCacheGeneration;
+
+#ifndef QT_NO_OPENSSL
+    struct SslServerEntry
+    {
+      SslServerEntry()
+          : generation( -1 ), custom( false ), protocol( QSsl::SecureProtocols )
+          , verifymode( QSslSocket::AutoVerifyPeer ), verifydepth( 0 ) {}
+      int generation;
+      bool custom; // whether a custom server config exists
+      QSsl::SslProtocol protocol;
+      QSslSocket::PeerVerifyMode verifymode;
+      int verifydepth;
+    };
+
+    // custom SSL server config settings, keyed by host:port
+    static QgsAuthCache<SslServerEntry> mSslServerCache;
+#endif
+
+    QHash<QString, QgsAuthFailure> mFailures;
+    QMutex mFailuresMutex;
+};
+
+/** \ingroup core
+ * \brief Storage set for a basic config and its precomputed Authorization header value
+ * \since 2.8
+ */
+class CORE_EXPORT QgsAuthBasicBundle
+{
+  public:
+    explicit QgsAuthBasicBundle( const QgsAuthConfigBasic& config );
+
+    const QgsAuthConfigBasic& config() const { return mConfig; }
+
+    /** Value for the Authorization header, or empty if config has no username */
+    const QByteArray authorizationHeader() const { return mHeader; }
+
+    /** Approximate memory used, in bytes, for cache accounting */
+    int cost() const;
+
+  private:
+    QgsAuthConfigBasic mConfig;
+    QByteArray mHeader;
 };
 
 /** \ingroup core
@@ -75,16 +203,20 @@ class CORE_EXPORT QgsAuthProviderBasic : public QgsAuthProvider
     bool updateNetworkRequest( QNetworkRequest &request, const QString &authcfg );
     bool updateNetworkReply( QNetworkReply *reply, const QString &authcfg );
     void clearCachedConfig( const QString& authcfg );
+    bool warmCachedConfig( const QString& authcfg ) { return !getAuthBasicBundle( authcfg ).isNull(); }
+    QgsAuthCacheStats cacheStats() const { return mAuthBasicCache.stats(); }
 
   private:
 
-    QgsAuthConfigBasic getAuthBasicConfig( const QString& authcfg );
+    /** Get cached basic bundle, or build and cache it; null if config could not be loaded */
+    QSharedPointer<QgsAuthBasicBundle> getAuthBasicBundle( const QString& authcfg );
 
-    void putAuthBasicConfig( const QString& authcfg, QgsAuthConfigBasic config );
+    void putAuthBasicBundle( const QString& authcfg, const QSharedPointer<QgsAuthBasicBundle>& bundle, int generation );
 
-    void removeAuthBasicConfig( const QString& authcfg );
+    void removeAuthBasicBundle( const QString& authcfg );
 
-    static QMap<QString, QgsAuthConfigBasic> mAuthBasicCache;
+    // read-mostly, shared by network requests from any thread
+    static QgsAuthCache< QSharedPointer<QgsAuthBasicBundle> > mAuthBasicCache;
 };
 
 
@@ -112,10 +244,18 @@ class CORE_EXPORT QgsPkiBundle
     const QSslKey clientCertKey() const { return mCertKey; }
     void setClientCertKey( const QSslKey& certkey ) { mCertKey = certkey; }
 
+    /** Issuer chain of client cert, e.g. from a PKCS#12 bundle, excluding the client cert */
+    const QList<QSslCertificate> caChain() const { return mCaChain; }
+    void setCaChain( const QList<QSslCertificate>& cachain ) { mCaChain = cachain; }
+
+    /** Approximate memory used, in bytes, for cache accounting */
+    int cost() const;
+
   private:
     QgsAuthConfigBase mConfig;
     QSslCertificate mCert;
     QSslKey mCertKey;
+    QList<QSslCertificate> mCaChain;
 };
 
 /** \ingroup core
@@ -133,6 +273,8 @@ class CORE_EXPORT QgsAuthProviderPkiPaths : public QgsAuthProvider
     bool updateNetworkRequest( QNetworkRequest &request, const QString &authcfg );
     bool updateNetworkReply( QNetworkReply *reply, const QString &authcfg );
     void clearCachedConfig( const QString& authcfg );
+    bool warmCachedConfig( const QString& authcfg ) { return !getPkiBundle( authcfg ).isNull(); }
+    QgsAuthCacheStats cacheStats() const { return mPkiBundleCache.stats(); }
 
     static const QByteArray certAsPem( const QString &certpath );
 
@@ -143,15 +285,22 @@ class CORE_EXPORT QgsAuthProviderPkiPaths : public QgsAuthProvider
 
   protected:
 
-    virtual QgsPkiBundle * getPkiBundle( const QString &authcfg );
+    /** Get cached PKI bundle, or build and cache it
+     * @note Shared, so it stays valid for the caller if concurrently removed from cache
+     */
+    virtual QSharedPointer<QgsPkiBundle> getPkiBundle( const QString &authcfg );
 
-    virtual void putPkiBundle( const QString &authcfg, QgsPkiBundle * pkibundle );
+    virtual void putPkiBundle( const QString &authcfg, const QSharedPointer<QgsPkiBundle>& pkibundle, int generation );
 
     virtual void removePkiBundle( const QString &authcfg );
 
+    /** Get PKI bundle from cache only, or null pointer */
+    static QSharedPointer<QgsPkiBundle> cachedPkiBundle( const QString &authcfg );
+
   private:
 
-    static QMap<QString, QgsPkiBundle *> mPkiBundleCache;
+    // read-mostly, shared by network requests from any thread (also used by PKCS#12 subclass)
+    static QgsAuthCache< QSharedPointer<QgsPkiBundle> > mPkiBundleCache;
 };
 
 /** \ingroup core
@@ -166,17 +315,42 @@ class CORE_EXPORT QgsAuthProviderPkiPkcs12 : public QgsAuthProviderPkiPaths
 
     ~QgsAuthProviderPkiPkcs12();
 
+    // QgsAuthProvider interface
+    void clearCachedConfig( const QString& authcfg );
+
     static const QString certAsPem( const QString &bundlepath, const QString &bundlepass );
 
-    static const QString keyAsPem( const QString &bundlepath, const QString &bundlepass, bool reencrypt = true );
+    static const QString keyAsPem( const QString &bundlepath, const QString &bundlepass,
+                                   bool reencrypt = true, QString *algtype = 0 );
+
+    /**
+     * Load client cert, its CA chain and private key from a PKCS#12 bundle, with one read and parse
+     * @param authcfg Config the bundle belongs to; if set, recent results are reused while the file
+     * is unchanged, until the config is cleared from cache
+     * @param keyalg Set to key algorithm: "rsa", "dsa" or "ec"
+     * @return Whether bundle could be read and has both a cert and key
+     */
+    static bool loadBundle( const QString &bundlepath, const QString &bundlepass,
+                            QSslCertificate *cert, QSslKey *key,
+                            QList<QSslCertificate> *cachain = 0,
+                            const QString &authcfg = QString(), QString *keyalg = 0 );
 
   protected:
 
-    QgsPkiBundle * getPkiBundle( const QString &authcfg );
+    QSharedPointer<QgsPkiBundle> getPkiBundle( const QString &authcfg );
 
   private:
-
-    static QMap<QString, QgsPkiBundle *> mPkiBundleCache;
+    struct Pkcs12Entry
+    {
+      QString filestate; // path, size and modified time
+      QSslCertificate cert;
+      QSslKey key;
+      QString keyalg;
+      QList<QSslCertificate> cachain;
+    };
+
+    // parsed bundles by authcfg, small and short-lived, so rebuilds of a config's bundle share a parse
+    static QgsAuthCache<Pkcs12Entry> mPkcs12Cache;
 };
 
 /** \ingroup core
@@ -194,6 +368,8 @@ class CORE_EXPORT QgsAuthProviderIdentityCert : public QgsAuthProvider
     bool updateNetworkRequest( QNetworkRequest &request, const QString &authcfg );
     bool updateNetworkReply( QNetworkReply *reply, const QString &authcfg );
     void clearCachedConfig( const QString& authcfg );
+    bool warmCachedConfig( const QString& authcfg ) { return !getPkiBundle( authcfg ).isNull(); }
+    QgsAuthCacheStats cacheStats() const { return mPkiBundleCache.stats(); }
 
     static const QByteArray certAsPem( const QString &certid );
 
@@ -203,15 +379,19 @@ class CORE_EXPORT QgsAuthProviderIdentityCert : public QgsAuthProvider
 
   protected:
 
-    virtual QgsPkiBundle * getPkiBundle( const QString &authcfg );
+    /** Get cached PKI bundle, or build and cache it
+     * @note Shared, so it stays valid for the caller if concurrently removed from cache
+     */
+    virtual QSharedPointer<QgsPkiBundle> getPkiBundle( const QString &authcfg );
 
-    virtual void putPkiBundle( const QString &authcfg, QgsPkiBundle * pkibundle );
+    virtual void putPkiBundle( const QString &authcfg, const QSharedPointer<QgsPkiBundle>& pkibundle, int generation );
 
     virtual void removePkiBundle( const QString &authcfg );
 
   private:
 
-    static QMap<QString, QgsPkiBundle *> mPkiBundleCache;
+    // read-mostly, shared by network requests from any thread
+    static QgsAuthCache< QSharedPointer<QgsPkiBundle> > mPkiBundleCache;
 };
 
 #endif
@@ -163,7 +163,8 @@ QNetworkReply *QgsNetworkAccessManager::createRequest( QNetworkAccessManager::Op
 #ifndef QT_NO_OPENSSL
   bool ishttps = pReq->url().scheme().toLower() == "https";
   QgsAuthConfigSslServer servconfig;
-  if ( ishttps )
+  // an authentication provider may have already applied a complete SSL configuration
+  if ( ishttps && !pReq->attribute( QgsAuthProvider::sslConfigAppliedAttribute() ).toBool() )
   {
     // check for SSL cert custom config
     QString hostport( QString( "%1:%2" )
@@ -218,6 +219,16 @@ void QgsNetworkAccessManager::abortRequest()
   emit requestTimedOut( reply );
 }
 
+void QgsNetworkAccessManager::authConfigFilesChanged( const QStringList& authcfgs )
+{
+  QgsDebugMsg( QString( "Auth config files changed for: %1" ).arg( authcfgs.join( ", " ) ) );
+  Q_UNUSED( authcfgs );
+#if QT_VERSION >= 0x050000
+  // connections are not tracked per config, so drop them all
+  clearAccessCache();
+#endif
+}
+
 QString QgsNetworkAccessManager::cacheLoadControlName( QNetworkRequest::CacheLoadControl theControl )
 {
   switch ( theControl )
@@ -292,6 +303,9 @@ void QgsNetworkAccessManager::setupDefaultProxyAndCache()
 #endif
   }
 
+  connect( QgsAuthManager::instance(), SIGNAL( configFilesChanged( const QStringList& ) ),
+           this, SLOT( authConfigFilesChanged( const QStringList& ) ), Qt::UniqueConnection );
+
   // check if proxy is enabled
   bool proxyEnabled = settings.value( "proxy/proxyEnabled", false ).toBool();
   if ( proxyEnabled )
@@ -90,6 +90,9 @@ class CORE_EXPORT QgsNetworkAccessManager : public QNetworkAccessManager, public
   private slots:
     void abortRequest();
 
+    //! Drop pooled connections, which may still use credentials from rotated files
+    void authConfigFilesChanged( const QStringList& authcfgs );
+
   protected:
     virtual QNetworkReply *createRequest( QNetworkAccessManager::Operation op, const QNetworkRequest &req, QIODevice *outgoingData = 0 );
 
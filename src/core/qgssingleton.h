@@ -16,23 +16,46 @@
 #ifndef QGSSINGLETON_H
 #define QGSSINGLETON_H
 
+#include <QAtomicPointer>
+#include <QMutex>
+
+/**
+ * Singleton template, with race-free instance creation
+ * @note Double-checked: only first calls contend for the creation lock
+ */
 template <typename T>
 class QgsSingleton
 {
   public:
     static T* instance()
     {
-      if ( sInstance == 0 )
+      T* inst = loadInstance();
+      if ( !inst )
       {
-        sInstance = createInstance();
+        QMutexLocker locker( &sMutex );
+        inst = loadInstance();
+        if ( !inst )
+        {
+          inst = createInstance();
+          sInstance.fetchAndStoreRelease( inst );
+        }
       }
-      return sInstance;
+      return inst;
     }
 
+    /** Delete the instance
+     * @note The instance is unpublished under the creation lock, but deleted outside it, so its destructor
+     * may wait on threads without deadlocking them in instance(). instance() must not be called during
+     * teardown, e.g. by those threads: it would create a new instance.
+     */
     static void cleanup()
     {
-      delete sInstance;
-      sInstance = 0;
+      T* inst;
+      {
+        QMutexLocker locker( &sMutex );
+        inst = sInstance.fetchAndStoreOrdered( 0 );
+      }
+      delete inst;
     }
 
   protected:
@@ -43,13 +66,25 @@ class QgsSingleton
     }
 
   private:
-    static T* sInstance;
+    static QAtomicPointer<T> sInstance;
+    static QMutex sMutex;
+
     static T* createInstance()
     {
       return new T;
     }
+
+    static T* loadInstance()
+    {
+#if QT_VERSION >= 0x050000
+      return sInstance.loadAcquire();
+#else
+      return sInstance.fetchAndAddAcquire( 0 );
+#endif
+    }
 };
 
-template <typename T> T* QgsSingleton<T>::sInstance = 0;
+template <typename T> QAtomicPointer<T> QgsSingleton<T>::sInstance( 0 );
+template <typename T> QMutex QgsSingleton<T>::sMutex;
 
 #endif // QGSSINGLETON_H
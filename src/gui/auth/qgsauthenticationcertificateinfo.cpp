@@ -545,7 +545,7 @@ void QgsAuthCertInfo::populateInfoDetailsSection()
                 mCurrentACert.subjectInfo().value( QCA::Email ),
                 LineEdit );
   addFieldItem( mGrpSubj, tr( "Distinguished name" ),
-                QgsAuthCertUtils::getCertDistinguishedName( mCurrentQCert, mCurrentACert, false ),
+                QgsAuthCertUtils::getCertDistinguishedName( mCurrentQCert, false ),
                 LineEdit );
   addFieldItem( mGrpSubj, tr( "Email Legacy" ),
                 mCurrentACert.subjectInfo().value( QCA::EmailLegacy ),
@@ -613,7 +613,7 @@ void QgsAuthCertInfo::populateInfoDetailsSection()
                 mCurrentACert.issuerInfo().value( QCA::Email ),
                 LineEdit );
   addFieldItem( mGrpIssu, tr( "Distinguished name" ),
-                QgsAuthCertUtils::getCertDistinguishedName( mCurrentQCert, mCurrentACert, true ),
+                QgsAuthCertUtils::getCertDistinguishedName( mCurrentQCert, true ),
                 LineEdit );
   addFieldItem( mGrpIssu, tr( "Email Legacy" ),
                 mCurrentACert.issuerInfo().value( QCA::EmailLegacy ),
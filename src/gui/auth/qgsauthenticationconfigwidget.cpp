@@ -760,18 +760,16 @@ void QgsAuthConfigWidget::populateIdentityComboBox()
 {
   cmbIdentityCert->addItem( tr( "Select identity..." ) );
 
-  QList<QSslCertificate> certs( QgsAuthManager::instance()->getCertIdentities() );
-  if ( !certs.isEmpty() )
+  QMap<QString, QString> names( QgsAuthManager::instance()->getCertIdentityNames() );
+  if ( !names.isEmpty() )
   {
     cmbIdentityCert->setIconSize( QSize( 26, 22 ) );
+    // sorted by name
     QMap<QString, QString> idents;
-    Q_FOREACH( const QSslCertificate& cert, certs )
+    QMap<QString, QString>::const_iterator nt = names.constBegin();
+    for ( ; nt != names.constEnd(); ++nt )
     {
-      QString org( cert.subjectInfo( QSslCertificate::Organization ) );
-      if ( org.isEmpty() )
-        org = tr( "Organization not defined" );
-      idents.insert( QString( "%1 (%2)" ).arg( QgsAuthCertUtils::resolvedCertName( cert ) ).arg( org ),
-                     QgsAuthCertUtils::shaHexForCert( cert ) );
+      idents.insert( nt.value(), nt.key() );
     }
     QMap<QString, QString>::const_iterator it = idents.constBegin();
     for ( ; it != idents.constEnd(); ++it )